@@ -0,0 +1,245 @@
+#include "archive.hpp"
+#include "checksum.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace tiler {
+
+namespace {
+
+constexpr size_t kTarBlock = 512;
+
+// Octal field, or base-256 when the value does not fit (GNU extension)
+void tar_number(char *field, size_t width, uint64_t value) {
+  if (value < (uint64_t(1) << (3 * (width - 1)))) {
+    std::snprintf(field, width, "%0*llo", static_cast<int>(width - 1),
+                  static_cast<unsigned long long>(value));
+    return;
+  }
+  field[0] = static_cast<char>(0x80);
+  for (size_t i = width - 1; i > 0; --i) {
+    field[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+void put_le(std::string &out, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+} // namespace
+
+size_t TarWriter::add(const std::string &name, const std::vector<char> &data) {
+  char header[kTarBlock] = {};
+
+  // Names over 100 bytes are split at a slash into prefix and name
+  std::string prefix;
+  std::string file = name;
+  if (file.size() > 100) {
+    size_t slash = name.rfind('/', 155);
+    if (slash == std::string::npos || name.size() - slash - 1 > 100) {
+      throw std::runtime_error("Archive entry name too long: " + name);
+    }
+    prefix = name.substr(0, slash);
+    file = name.substr(slash + 1);
+  }
+
+  std::memcpy(header, file.data(), file.size());
+  tar_number(header + 100, 8, 0644);
+  tar_number(header + 108, 8, 0);
+  tar_number(header + 116, 8, 0);
+  tar_number(header + 124, 12, data.size());
+  tar_number(header + 136, 12, 0);
+  header[156] = '0';
+  std::memcpy(header + 257, "ustar", 6);
+  std::memcpy(header + 263, "00", 2);
+  std::memcpy(header + 345, prefix.data(), prefix.size());
+
+  // The checksum is computed with its own field set to spaces
+  std::memset(header + 148, ' ', 8);
+  unsigned int checksum = 0;
+  for (unsigned char c : header) {
+    checksum += c;
+  }
+  std::snprintf(header + 148, 8, "%06o", checksum);
+
+  sink_.write(header, kTarBlock);
+  size_t data_offset = offset_ + kTarBlock;
+  sink_.write(data.data(), data.size());
+
+  size_t padding = (kTarBlock - data.size() % kTarBlock) % kTarBlock;
+  char zeros[kTarBlock] = {};
+  sink_.write(zeros, padding);
+
+  offset_ = data_offset + data.size() + padding;
+  return data_offset;
+}
+
+void TarWriter::finish() {
+  char zeros[2 * kTarBlock] = {};
+  sink_.write(zeros, sizeof(zeros));
+  offset_ += sizeof(zeros);
+}
+
+size_t ZipWriter::add(const std::string &name, const std::vector<char> &data) {
+  if (data.size() >= 0xffffffff) {
+    throw std::runtime_error("Archive entry too large: " + name);
+  }
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(data.data()),
+                       data.size());
+
+  // Local file header; sizes are known up front, so no data descriptor
+  std::string header;
+  put_le(header, 0x04034b50, 4);
+  put_le(header, 20, 2);   // version needed
+  put_le(header, 0, 2);    // flags
+  put_le(header, 0, 2);    // stored
+  put_le(header, 0, 2);    // time
+  put_le(header, 0x21, 2);   // date: 1980-01-01
+  put_le(header, crc, 4);
+  put_le(header, data.size(), 4);
+  put_le(header, data.size(), 4);
+  put_le(header, name.size(), 2);
+  put_le(header, 0, 2);    // extra length
+  header += name;
+
+  sink_.write(header.data(), header.size());
+  sink_.write(data.data(), data.size());
+
+  entries_.push_back({name, crc, data.size(), offset_});
+  size_t data_offset = offset_ + header.size();
+  offset_ = data_offset + data.size();
+  return data_offset;
+}
+
+void ZipWriter::finish() {
+  uint64_t directory_offset = offset_;
+  std::string directory;
+  for (const auto &entry : entries_) {
+    bool zip64 = entry.offset >= 0xffffffff;
+    put_le(directory, 0x02014b50, 4);
+    put_le(directory, (3 << 8) | 45, 2); // made by: Unix, zip 4.5
+    put_le(directory, zip64 ? 45 : 20, 2);
+    put_le(directory, 0, 2);
+    put_le(directory, 0, 2);
+    put_le(directory, 0, 2);
+    put_le(directory, 0x21, 2);
+    put_le(directory, entry.crc, 4);
+    put_le(directory, entry.size, 4);
+    put_le(directory, entry.size, 4);
+    put_le(directory, entry.name.size(), 2);
+    put_le(directory, zip64 ? 12 : 0, 2);
+    put_le(directory, 0, 2);              // comment length
+    put_le(directory, 0, 2);              // disk
+    put_le(directory, 0, 2);              // internal attributes
+    put_le(directory, 0100644u << 16, 4); // regular file, rw-r--r--
+    put_le(directory, zip64 ? 0xffffffff : entry.offset, 4);
+    directory += entry.name;
+    if (zip64) {
+      put_le(directory, 0x0001, 2);
+      put_le(directory, 8, 2);
+      put_le(directory, entry.offset, 8);
+    }
+
+    // Keep the buffered directory small for pyramids with many tiles
+    if (directory.size() >= 1 << 20) {
+      sink_.write(directory.data(), directory.size());
+      offset_ += directory.size();
+      directory.clear();
+    }
+  }
+  sink_.write(directory.data(), directory.size());
+  offset_ += directory.size();
+  uint64_t directory_size = offset_ - directory_offset;
+
+  std::string trailer;
+  uint64_t count = entries_.size();
+  bool zip64 = count >= 0xffff || directory_offset >= 0xffffffff ||
+               directory_size >= 0xffffffff;
+  if (zip64) {
+    put_le(trailer, 0x06064b50, 4);
+    put_le(trailer, 44, 8); // size of the rest of this record
+    put_le(trailer, 45, 2);
+    put_le(trailer, 45, 2);
+    put_le(trailer, 0, 4);
+    put_le(trailer, 0, 4);
+    put_le(trailer, count, 8);
+    put_le(trailer, count, 8);
+    put_le(trailer, directory_size, 8);
+    put_le(trailer, directory_offset, 8);
+
+    put_le(trailer, 0x07064b50, 4);
+    put_le(trailer, 0, 4);
+    put_le(trailer, offset_, 8); // zip64 end of central directory
+    put_le(trailer, 1, 4);
+  }
+  put_le(trailer, 0x06054b50, 4);
+  put_le(trailer, 0, 2);
+  put_le(trailer, 0, 2);
+  put_le(trailer, zip64 ? 0xffff : count, 2);
+  put_le(trailer, zip64 ? 0xffff : count, 2);
+  put_le(trailer, zip64 ? 0xffffffff : directory_size, 4);
+  put_le(trailer, zip64 ? 0xffffffff : directory_offset, 4);
+  put_le(trailer, 0, 2);
+
+  sink_.write(trailer.data(), trailer.size());
+  offset_ += trailer.size();
+}
+
+std::string archive_file_name(const std::string &format) {
+  return "tiles." + format;
+}
+
+std::unique_ptr<ArchiveWriter> make_archive_writer(const std::string &format,
+                                                   ByteSink &sink) {
+  if (format == "tar") {
+    return std::make_unique<TarWriter>(sink);
+  }
+  if (format == "zip") {
+    return std::make_unique<ZipWriter>(sink);
+  }
+  throw std::runtime_error("Unsupported archive format: " + format);
+}
+
+TileInfo ArchiveTileWriter::store(const std::string &key,
+                                  const std::vector<char> &data,
+                                  const std::string &extension) {
+  int level, y, x;
+  parse_tile_key(key, level, y, x);
+  std::string name = prefix_ + std::to_string(level) + "/" +
+                     std::to_string(y) + "/" + std::to_string(x) + extension +
+                     ".gz";
+
+  std::vector<char> compressed = gzip_compress(data);
+  size_t offset = archive_.add(name, compressed);
+  return {key, archive_name_, offset, compressed.size(),
+          crc32c(compressed.data(), compressed.size())};
+}
+
+const TileInfo &ArchiveTileWriter::add(const std::string &key,
+                                       const std::vector<char> &data) {
+  tiles_.push_back(store(key, data, suffix_));
+  return tiles_.back();
+}
+
+const TileInfo &ArchiveTileWriter::add_mask(const std::string &key,
+                                            const std::vector<char> &data) {
+  masks_.push_back(store(key, data, ".mask.png"));
+  return masks_.back();
+}
+
+void ArchiveTileWriter::add_index(int width, int height, int tile_size) {
+  std::ostringstream metadata;
+  write_metadata(metadata, {width, height, tile_size, tiles_, masks_, 0, {}});
+  std::string text = metadata.str();
+  archive_.add(prefix_ + "metadata.json",
+               std::vector<char>(text.begin(), text.end()));
+}
+
+} // namespace tiler
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "binz.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Single-pass archive output: tiles and their index written sequentially
+// into one file or stream that standard tools can unpack.
+
+namespace tiler {
+
+// Writes files into an archive in one sequential pass
+class ArchiveWriter {
+public:
+  virtual ~ArchiveWriter() = default;
+
+  // Append one file and return the offset of its data in the archive
+  virtual size_t add(const std::string &name,
+                     const std::vector<char> &data) = 0;
+
+  // Write the trailer; nothing can be added afterwards
+  virtual void finish() = 0;
+};
+
+// POSIX ustar archive
+class TarWriter : public ArchiveWriter {
+public:
+  explicit TarWriter(ByteSink &sink) : sink_(sink) {}
+
+  size_t add(const std::string &name, const std::vector<char> &data) override;
+  void finish() override;
+
+private:
+  ByteSink &sink_;
+  size_t offset_ = 0;
+};
+
+// Zip archive with stored (uncompressed) entries, switching to zip64 once
+// offsets or the entry count outgrow the classic format
+class ZipWriter : public ArchiveWriter {
+public:
+  explicit ZipWriter(ByteSink &sink) : sink_(sink) {}
+
+  size_t add(const std::string &name, const std::vector<char> &data) override;
+  void finish() override;
+
+private:
+  struct Entry {
+    std::string name;
+    uint32_t crc;
+    uint64_t size;
+    uint64_t offset;
+  };
+
+  ByteSink &sink_;
+  size_t offset_ = 0;
+  std::vector<Entry> entries_;
+};
+
+// Archive file name for a format: tiles.tar or tiles.zip
+std::string archive_file_name(const std::string &format);
+
+std::unique_ptr<ArchiveWriter> make_archive_writer(const std::string &format,
+                                                   ByteSink &sink);
+
+// Stores each tile as <prefix><level>/<y>/<x><suffix>.gz, and each alpha
+// mask as <prefix><level>/<y>/<x>.mask.png.gz, gzip-compressed exactly as in
+// a binary, so the index can point straight into the archive named
+// `archive_name`
+class ArchiveTileWriter : public TileSink {
+public:
+  ArchiveTileWriter(ArchiveWriter &archive, const std::string &archive_name,
+                    const std::string &prefix, const std::string &suffix)
+      : archive_(archive), archive_name_(archive_name), prefix_(prefix),
+        suffix_(suffix) {}
+
+  const TileInfo &add(const std::string &key,
+                      const std::vector<char> &data) override;
+  const TileInfo &add_mask(const std::string &key,
+                           const std::vector<char> &data) override;
+
+  // Append <prefix>metadata.json describing the tiles added so far
+  void add_index(int width, int height, int tile_size);
+
+private:
+  TileInfo store(const std::string &key, const std::vector<char> &data,
+                 const std::string &extension);
+
+  ArchiveWriter &archive_;
+  std::string archive_name_;
+  std::string prefix_;
+  std::string suffix_;
+};
+
+} // namespace tiler
@@ -0,0 +1,1110 @@
+#include "binz.hpp"
+#include "checksum.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tiler {
+
+void StreamSink::write(const char *data, size_t size) {
+  out_.write(data, size);
+  if (!out_) {
+    throw std::runtime_error("Failed to write binary");
+  }
+}
+
+const TileInfo &TileSink::add_compressed(const std::string &key,
+                                         const std::vector<char> &compressed,
+                                         bool mask) {
+  std::vector<char> data = gzip_decompress(compressed);
+  return mask ? add_mask(key, data) : add(key, data);
+}
+
+TileInfo TileWriter::append(const std::string &key,
+                            const std::vector<char> &compressed) {
+  size_t padding = (alignment_ - offset_ % alignment_) % alignment_;
+  if (padding > 0) {
+    std::vector<char> zeros(padding, 0);
+    sink_.write(zeros.data(), zeros.size());
+    offset_ += padding;
+  }
+  sink_.write(compressed.data(), compressed.size());
+  TileInfo tile{key, binary_name_, offset_, compressed.size(),
+                crc32c(compressed.data(), compressed.size())};
+  offset_ += compressed.size();
+  return tile;
+}
+
+const TileInfo &TileWriter::add(const std::string &key,
+                                const std::vector<char> &data) {
+  tiles_.push_back(append(key, gzip_compress(data)));
+  return tiles_.back();
+}
+
+const TileInfo &TileWriter::add_mask(const std::string &key,
+                                     const std::vector<char> &data) {
+  masks_.push_back(append(key, gzip_compress(data)));
+  return masks_.back();
+}
+
+const TileInfo &TileWriter::add_compressed(const std::string &key,
+                                           const std::vector<char> &compressed,
+                                           bool mask) {
+  auto &list = mask ? masks_ : tiles_;
+  list.push_back(append(key, compressed));
+  return list.back();
+}
+
+SupertileWriter::SupertileWriter(ByteSink &sink,
+                                 const std::string &binary_name, int n,
+                                 size_t offset)
+    : sink_(sink), binary_name_(binary_name), offset_(offset) {
+  if (n < 1 || n > 65535) {
+    throw std::runtime_error("Supertile size out of range: " +
+                             std::to_string(n));
+  }
+  supertile_size_ = n;
+}
+
+const TileInfo &SupertileWriter::add(const std::string &key,
+                                     const std::vector<char> &data) {
+  return buffer(key, gzip_compress(data), false);
+}
+
+const TileInfo &SupertileWriter::add_mask(const std::string &key,
+                                          const std::vector<char> &data) {
+  return buffer(key, gzip_compress(data), true);
+}
+
+const TileInfo &
+SupertileWriter::add_compressed(const std::string &key,
+                                const std::vector<char> &compressed,
+                                bool mask) {
+  return buffer(key, compressed, mask);
+}
+
+const TileInfo &SupertileWriter::buffer(const std::string &key,
+                                        std::vector<char> compressed,
+                                        bool mask) {
+  int level, y, x;
+  parse_tile_key(key, level, y, x);
+  int block_row = y / supertile_size_;
+  if (level != level_ || block_row != block_row_) {
+    if (level < level_ || (level == level_ && block_row < block_row_)) {
+      throw std::runtime_error("Supertile tiles out of order at " + key);
+    }
+    flush();
+    level_ = level;
+    block_row_ = block_row;
+  }
+
+  handed_out_.push_back({key, binary_name_, 0, 0, std::nullopt});
+  pending_.push_back({y, x, mask, std::move(compressed), &handed_out_.back()});
+  return handed_out_.back();
+}
+
+// Write the buffered block row, one record per block in column order
+void SupertileWriter::flush() {
+  std::stable_sort(pending_.begin(), pending_.end(),
+                   [&](const Pending &a, const Pending &b) {
+                     return a.x / supertile_size_ < b.x / supertile_size_;
+                   });
+
+  for (size_t first = 0; first < pending_.size();) {
+    int block_column = pending_[first].x / supertile_size_;
+    size_t last = first;
+    while (last < pending_.size() &&
+           pending_[last].x / supertile_size_ == block_column) {
+      ++last;
+    }
+
+    std::string header("STIL", 4);
+    auto put_le = [&](uint64_t value, size_t bytes) {
+      for (size_t i = 0; i < bytes; ++i) {
+        header += static_cast<char>((value >> (8 * i)) & 0xff);
+      }
+    };
+    put_le(last - first, 4);
+    for (size_t i = first; i < last; ++i) {
+      put_le(pending_[i].y % supertile_size_, 2);
+      put_le(pending_[i].x % supertile_size_, 2);
+      put_le(pending_[i].mask ? 1 : 0, 4);
+      put_le(pending_[i].compressed.size(), 4);
+    }
+
+    size_t record_start = offset_;
+    sink_.write(header.data(), header.size());
+    offset_ += header.size();
+    uint32_t record_crc = crc32c(header.data(), header.size());
+    for (size_t i = first; i < last; ++i) {
+      Pending &tile = pending_[i];
+      sink_.write(tile.compressed.data(), tile.compressed.size());
+      tile.info->start_offset = offset_;
+      tile.info->size = tile.compressed.size();
+      tile.info->crc32c =
+          crc32c(tile.compressed.data(), tile.compressed.size());
+      record_crc =
+          crc32c(tile.compressed.data(), tile.compressed.size(), record_crc);
+      offset_ += tile.compressed.size();
+      (tile.mask ? masks_ : tiles_).push_back(*tile.info);
+    }
+    supertiles_.push_back({make_tile_key(level_, block_row_, block_column),
+                           binary_name_, record_start,
+                           offset_ - record_start, record_crc});
+    first = last;
+  }
+  pending_.clear();
+}
+
+void SupertileWriter::finish() { flush(); }
+
+LevelFiles::LevelFiles(const std::string &spec) {
+  if (spec == "each") {
+    each_ = true;
+    return;
+  }
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string level = spec.substr(start, end - start);
+    if (level.empty() || level.size() > 2 ||
+        !std::all_of(level.begin(), level.end(), ::isdigit) ||
+        (!starts_.empty() && std::stoi(level) <= starts_.back())) {
+      throw std::runtime_error("Invalid level files '" + spec +
+                               "' (use each, or ascending first levels "
+                               "such as 0,4,8)");
+    }
+    starts_.push_back(std::stoi(level));
+    start = end + 1;
+  }
+}
+
+std::string LevelFiles::binary_name(int level) const {
+  if (!each_ && starts_.empty()) {
+    return "tiles_000.binz";
+  }
+  int first = level;
+  if (!each_) {
+    // Levels before the first listed one join the group of level 0
+    auto next = std::upper_bound(starts_.begin(), starts_.end(), level);
+    first = next == starts_.begin() ? 0 : *(next - 1);
+  }
+  char name[32];
+  std::snprintf(name, sizeof(name), "tiles_l%02d.binz", first);
+  return name;
+}
+
+LevelTileWriter::LevelTileWriter(const fs::path &folder,
+                                 const LevelFiles &levels, int supertile,
+                                 bool append, size_t alignment)
+    : folder_(folder), levels_(levels), supertile_(supertile),
+      append_(append), alignment_(alignment) {
+  // A fresh output always has its first binary, even without tiles
+  if (!append_) {
+    writer_for(0);
+  }
+}
+
+TileSink &LevelTileWriter::writer_for(int level) {
+  std::string name = levels_.binary_name(level);
+  auto found = binaries_.find(name);
+  if (found != binaries_.end()) {
+    return *found->second.writer;
+  }
+
+  Binary &binary = binaries_[name];
+  binary.path = folder_ / name;
+  size_t offset = 0;
+  if (append_ && fs::exists(binary.path)) {
+    offset = fs::file_size(binary.path);
+  }
+  binary.file.open(binary.path, append_ ? std::ios::binary | std::ios::app
+                                        : std::ios::binary);
+  if (!binary.file) {
+    throw std::runtime_error("Cannot create binary file: " +
+                             binary.path.string());
+  }
+  binary.sink = std::make_unique<StreamSink>(binary.file);
+  if (supertile_ > 0) {
+    binary.writer = std::make_unique<SupertileWriter>(*binary.sink, name,
+                                                      supertile_, offset);
+  } else {
+    binary.writer = std::make_unique<TileWriter>(*binary.sink, name, offset,
+                                                 alignment_);
+  }
+  return *binary.writer;
+}
+
+const TileInfo &LevelTileWriter::add(const std::string &key,
+                                     const std::vector<char> &data) {
+  int level, y, x;
+  parse_tile_key(key, level, y, x);
+  return writer_for(level).add(key, data);
+}
+
+const TileInfo &LevelTileWriter::add_mask(const std::string &key,
+                                          const std::vector<char> &data) {
+  int level, y, x;
+  parse_tile_key(key, level, y, x);
+  return writer_for(level).add_mask(key, data);
+}
+
+const TileInfo &
+LevelTileWriter::add_compressed(const std::string &key,
+                                const std::vector<char> &compressed,
+                                bool mask) {
+  int level, y, x;
+  parse_tile_key(key, level, y, x);
+  return writer_for(level).add_compressed(key, compressed, mask);
+}
+
+void LevelTileWriter::flush() {
+  for (auto &entry : binaries_) {
+    Binary &binary = entry.second;
+    binary.file.flush();
+    if (!binary.file) {
+      throw std::runtime_error("Failed to write " + binary.path.string());
+    }
+  }
+}
+
+void LevelTileWriter::finish() {
+  // Binaries are named by first level, so they list in pyramid order
+  for (auto &[name, binary] : binaries_) {
+    binary.writer->finish();
+    binary.file.close();
+    if (!binary.file) {
+      throw std::runtime_error("Failed to write " + binary.path.string());
+    }
+    const TileSink &writer = *binary.writer;
+    tiles_.insert(tiles_.end(), writer.tiles().begin(), writer.tiles().end());
+    masks_.insert(masks_.end(), writer.masks().begin(), writer.masks().end());
+    supertiles_.insert(supertiles_.end(), writer.supertiles().begin(),
+                       writer.supertiles().end());
+  }
+  supertile_size_ = supertile_;
+}
+
+std::vector<char> gzip_compress(const std::vector<char> &data, int level) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+
+  if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("Failed to initialize gzip compression");
+  }
+
+  std::vector<char> compressed;
+  compressed.resize(deflateBound(&stream, data.size()));
+
+  stream.avail_in = data.size();
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_out = compressed.size();
+  stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&stream);
+    throw std::runtime_error("Failed to compress data");
+  }
+
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  return compressed;
+}
+
+std::vector<char> gzip_decompress(const std::vector<char> &data) {
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.avail_in = data.size();
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    throw std::runtime_error("Failed to initialize gzip decompression");
+  }
+
+  std::vector<char> decompressed(std::max<size_t>(data.size() * 2, 4096));
+  int status = Z_OK;
+  while (status != Z_STREAM_END) {
+    if (stream.total_out == decompressed.size()) {
+      decompressed.resize(decompressed.size() * 2);
+    }
+    stream.avail_out = decompressed.size() - stream.total_out;
+    stream.next_out =
+        reinterpret_cast<Bytef *>(decompressed.data() + stream.total_out);
+    status = inflate(&stream, Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END) {
+      inflateEnd(&stream);
+      throw std::runtime_error("Failed to decompress data");
+    }
+  }
+
+  decompressed.resize(stream.total_out);
+  inflateEnd(&stream);
+
+  return decompressed;
+}
+
+MappedFile::MappedFile(const fs::path &path) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open file: " + path.string());
+  }
+  struct stat info;
+  if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+    size_ = static_cast<size_t>(info.st_size);
+    void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      ::madvise(data, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char *>(data);
+      mapped_ = true;
+    }
+  }
+  ::close(fd);
+  if (mapped_ || size_ == 0) {
+    return;
+  }
+#endif
+  buffer_ = read_file(path);
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (mapped_) {
+    ::munmap(const_cast<char *>(data_), size_);
+  }
+#endif
+}
+
+std::vector<char> read_file(const fs::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot open file: " + path.string());
+  }
+  return std::vector<char>((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+}
+
+std::vector<char> read_file_range(const fs::path &path, size_t offset,
+                                  size_t size) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot open file: " + path.string());
+  }
+  std::vector<char> data(size);
+  file.seekg(offset);
+  file.read(data.data(), size);
+  if (static_cast<size_t>(file.gcount()) != size) {
+    throw std::runtime_error("Short read from: " + path.string());
+  }
+  return data;
+}
+
+std::string make_tile_key(int level, int y, int x) {
+  return std::to_string(level) + "_" + std::to_string(y) + "_" +
+         std::to_string(x);
+}
+
+void parse_tile_key(const std::string &key, int &level, int &y, int &x) {
+  const char *p = key.data();
+  const char *end = p + key.size();
+  for (int *value : {&level, &y, &x}) {
+    auto [next, error] = std::from_chars(p, end, *value);
+    if (error != std::errc() ||
+        (value != &x && (next == end || *next != '_'))) {
+      throw std::runtime_error("Malformed tile key: " + key);
+    }
+    p = next + 1;
+  }
+}
+
+// One "<name>": {<key>: {binaryName, startOffset, size, crc32c}, ...}
+// object
+void write_tile_map(std::ostream &meta_file, const std::string &name,
+                    const std::vector<TileInfo> &tiles_map) {
+  meta_file << "  \"" << name << "\": {\n";
+
+  for (size_t i = 0; i < tiles_map.size(); ++i) {
+    const auto &tile = tiles_map[i];
+    meta_file << "    \"" << tile.key << "\": {\n";
+    meta_file << "      \"binaryName\": \"" << tile.binary_name << "\",\n";
+    meta_file << "      \"startOffset\": " << tile.start_offset << ",\n";
+    meta_file << "      \"size\": " << tile.size;
+    if (tile.crc32c) {
+      meta_file << ",\n      \"crc32c\": " << *tile.crc32c;
+    }
+    meta_file << "\n    }";
+    if (i < tiles_map.size() - 1) {
+      meta_file << ",";
+    }
+    meta_file << "\n";
+  }
+
+  meta_file << "  }";
+}
+
+void write_metadata(std::ostream &meta_file, const TileIndex &index) {
+  meta_file << "{\n";
+  meta_file << "  \"width\": " << index.width << ",\n";
+  meta_file << "  \"height\": " << index.height << ",\n";
+  meta_file << "  \"tile_size\": " << index.tile_size << ",\n";
+  write_tile_map(meta_file, "tiles", index.tiles);
+  if (!index.masks.empty()) {
+    meta_file << ",\n";
+    write_tile_map(meta_file, "masks", index.masks);
+  }
+  if (!index.supertiles.empty()) {
+    meta_file << ",\n  \"supertile_size\": " << index.supertile_size << ",\n";
+    write_tile_map(meta_file, "supertiles", index.supertiles);
+  }
+  meta_file << "\n}\n";
+}
+
+void write_metadata(const fs::path &output_folder, int width, int height,
+                    int tile_size, const std::vector<TileInfo> &tiles_map,
+                    const std::vector<TileInfo> &masks) {
+  write_metadata(output_folder,
+                 {width, height, tile_size, tiles_map, masks, 0, {}});
+}
+
+void write_metadata(const fs::path &output_folder, const TileIndex &index) {
+  fs::path meta_path = output_folder / "metadata.json";
+  std::ofstream meta_file(meta_path);
+
+  if (!meta_file) {
+    throw std::runtime_error("Cannot create metadata file: " +
+                             meta_path.string());
+  }
+
+  write_metadata(meta_file, index);
+
+  meta_file.close();
+
+  // Each level binary gets the index of its own tiles, so that it can be
+  // served or cached apart from the rest of the output
+  std::map<std::string, TileIndex> binaries;
+  auto split = [&](const std::vector<TileInfo> &tiles,
+                   std::vector<TileInfo> TileIndex::*list) {
+    for (const auto &tile : tiles) {
+      if (tile.binary_name != "tiles_000.binz") {
+        TileIndex &part = binaries[tile.binary_name];
+        part.width = index.width;
+        part.height = index.height;
+        part.tile_size = index.tile_size;
+        part.supertile_size = index.supertile_size;
+        (part.*list).push_back(tile);
+      }
+    }
+  };
+  split(index.tiles, &TileIndex::tiles);
+  split(index.masks, &TileIndex::masks);
+  split(index.supertiles, &TileIndex::supertiles);
+  for (const auto &[name, part] : binaries) {
+    write_binary_index(
+        output_folder / fs::path(name).replace_extension(".idx"), part);
+  }
+}
+
+namespace {
+
+// Reader for the metadata.json layout written above. It accepts any
+// whitespace and skips members it does not know. Parsing runs over the
+// text in place: member names are compared without copying, and strings
+// are scanned for their closing quote 16 bytes at a time where SSE2 is
+// available.
+class MetadataParser {
+public:
+  // Bytes write_metadata spends on a tile entry, to size the tile lists
+  static constexpr size_t kTileEntryBytes = 128;
+
+  MetadataParser(const char *data, size_t size, const std::string &name)
+      : begin_(data), pos_(data), end_(data + size), name_(name) {}
+
+  TileIndex parse() {
+    TileIndex index;
+    parse_object([&](std::string_view key) {
+      if (key == "width") {
+        index.width = static_cast<int>(parse_number());
+      } else if (key == "height") {
+        index.height = static_cast<int>(parse_number());
+      } else if (key == "tile_size") {
+        index.tile_size = static_cast<int>(parse_number());
+      } else if (key == "tiles") {
+        parse_tile_map(index.tiles);
+      } else if (key == "masks") {
+        parse_tile_map(index.masks);
+      } else if (key == "supertile_size") {
+        index.supertile_size = static_cast<int>(parse_number());
+      } else if (key == "supertiles") {
+        parse_tile_map(index.supertiles);
+      } else {
+        skip_value();
+      }
+    });
+    return index;
+  }
+
+private:
+  template <typename Fn> void parse_object(Fn member) {
+    expect('{');
+    if (peek() == '}') {
+      ++pos_;
+      return;
+    }
+    while (true) {
+      std::string_view key = parse_string();
+      expect(':');
+      member(key);
+      char c = next();
+      if (c == '}') {
+        return;
+      }
+      if (c != ',') {
+        fail();
+      }
+    }
+  }
+
+  void parse_tile_map(std::vector<TileInfo> &tiles) {
+    // Tiles mostly share one binary, so its name is kept between them
+    std::string binary_name;
+    tiles.reserve((end_ - pos_) / kTileEntryBytes);
+    parse_object([&](std::string_view key) {
+      TileInfo tile{std::string(key), "", 0, 0, std::nullopt};
+      parse_object([&](std::string_view field) {
+        if (field == "binaryName") {
+          std::string_view name = parse_string();
+          if (name != binary_name) {
+            binary_name = name;
+          }
+          tile.binary_name = binary_name;
+        } else if (field == "startOffset") {
+          tile.start_offset = parse_number();
+        } else if (field == "size") {
+          tile.size = parse_number();
+        } else if (field == "crc32c") {
+          tile.crc32c = static_cast<uint32_t>(parse_number());
+        } else {
+          skip_value();
+        }
+      });
+      tiles.push_back(std::move(tile));
+    });
+  }
+
+  // Contents of a string, which stay valid as long as the text. Escapes are
+  // resolved into scratch storage; write_metadata never emits any.
+  std::string_view parse_string() {
+    expect('"');
+    const char *start = pos_;
+    pos_ = find_quote_or_escape(pos_);
+    if (pos_ < end_ && *pos_ == '"') {
+      ++pos_;
+      return std::string_view(start, pos_ - 1 - start);
+    }
+
+    std::string &value = scratch_[scratch_index_++ % 2];
+    value.assign(start, pos_);
+    while (pos_ < end_ && *pos_ == '\\') {
+      ++pos_;
+      parse_escape(value);
+      const char *run = pos_;
+      pos_ = find_quote_or_escape(pos_);
+      value.append(run, pos_);
+    }
+    expect('"');
+    return value;
+  }
+
+  // Append the character escaped after a backslash, with \uXXXX (and
+  // surrogate pairs) encoded as UTF-8
+  void parse_escape(std::string &value) {
+    if (pos_ >= end_) {
+      fail();
+    }
+    char c = *pos_++;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      value += c;
+      return;
+    case 'b':
+      value += '\b';
+      return;
+    case 'f':
+      value += '\f';
+      return;
+    case 'n':
+      value += '\n';
+      return;
+    case 'r':
+      value += '\r';
+      return;
+    case 't':
+      value += '\t';
+      return;
+    case 'u':
+      break;
+    default:
+      fail();
+    }
+
+    uint32_t code = parse_hex4();
+    if (code >= 0xD800 && code < 0xDC00) {
+      if (end_ - pos_ < 2 || pos_[0] != '\\' || pos_[1] != 'u') {
+        fail();
+      }
+      pos_ += 2;
+      uint32_t low = parse_hex4();
+      if (low < 0xDC00 || low >= 0xE000) {
+        fail();
+      }
+      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    } else if (code >= 0xDC00 && code < 0xE000) {
+      fail();
+    }
+
+    if (code < 0x80) {
+      value += static_cast<char>(code);
+    } else if (code < 0x800) {
+      value += static_cast<char>(0xC0 | (code >> 6));
+      value += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      value += static_cast<char>(0xE0 | (code >> 12));
+      value += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      value += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+      value += static_cast<char>(0xF0 | (code >> 18));
+      value += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+      value += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      value += static_cast<char>(0x80 | (code & 0x3F));
+    }
+  }
+
+  uint32_t parse_hex4() {
+    if (end_ - pos_ < 4) {
+      fail();
+    }
+    uint32_t code = 0;
+    for (int i = 0; i < 4; ++i) {
+      char c = *pos_++;
+      code <<= 4;
+      if (c >= '0' && c <= '9') {
+        code |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        code |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        code |= c - 'A' + 10;
+      } else {
+        fail();
+      }
+    }
+    return code;
+  }
+
+  // First '"' or '\\' at or after `p`, or the end of the text
+  const char *find_quote_or_escape(const char *p) const {
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i escape = _mm_set1_epi8('\\');
+    while (end_ - p >= 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      int mask = _mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                       _mm_cmpeq_epi8(chunk, escape)));
+      if (mask != 0) {
+        return p + __builtin_ctz(mask);
+      }
+      p += 16;
+    }
+#endif
+    while (p < end_ && *p != '"' && *p != '\\') {
+      ++p;
+    }
+    return p;
+  }
+
+  uint64_t parse_number() {
+    peek();
+    const char *start = pos_;
+    uint64_t value = 0;
+    while (pos_ < end_ && *pos_ >= '0' && *pos_ <= '9') {
+      value = value * 10 + (*pos_++ - '0');
+    }
+    if (pos_ == start) {
+      fail();
+    }
+    return value;
+  }
+
+  void skip_value() {
+    char c = peek();
+    if (c == '"') {
+      parse_string();
+    } else if (c == '{') {
+      parse_object([&](std::string_view) { skip_value(); });
+    } else if (c == '[') {
+      ++pos_;
+      if (peek() == ']') {
+        ++pos_;
+        return;
+      }
+      do {
+        skip_value();
+      } while (next() == ',');
+      if (pos_[-1] != ']') {
+        fail();
+      }
+    } else {
+      // Number, true, false or null
+      while (pos_ < end_ && *pos_ != ',' && *pos_ != '}' && *pos_ != ']' &&
+             !is_space(*pos_)) {
+        ++pos_;
+      }
+    }
+  }
+
+  static bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  // Next non-whitespace character, left in place
+  char peek() {
+    while (pos_ < end_ && is_space(*pos_)) {
+      ++pos_;
+    }
+    if (pos_ >= end_) {
+      fail();
+    }
+    return *pos_;
+  }
+
+  char next() {
+    char c = peek();
+    ++pos_;
+    return c;
+  }
+
+  void expect(char c) {
+    if (next() != c) {
+      fail();
+    }
+  }
+
+  [[noreturn]] void fail() {
+    throw std::runtime_error("Malformed metadata at byte " +
+                             std::to_string(pos_ - begin_) + ": " + name_);
+  }
+
+  const char *begin_;
+  const char *pos_;
+  const char *end_;
+  const std::string &name_;
+  // Unescaped strings; a member name must survive parsing its value
+  std::string scratch_[2];
+  size_t scratch_index_ = 0;
+};
+
+} // namespace
+
+TileIndex read_metadata(std::istream &in, const std::string &name) {
+  std::string text((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  return MetadataParser(text.data(), text.size(), name).parse();
+}
+
+TileIndex read_metadata(const fs::path &output_folder) {
+  fs::path meta_path = output_folder / "metadata.json";
+  if (!fs::exists(meta_path)) {
+    throw std::runtime_error("Cannot open metadata file: " +
+                             meta_path.string());
+  }
+  MappedFile text(meta_path);
+  return MetadataParser(text.data(), text.size(), meta_path.string())
+      .parse();
+}
+
+// Compact binary counterpart of metadata.json. All integers are little
+// endian:
+//   "TIDX", u32 version, u32 width, u32 height, u32 tile_size,
+//   u32 binary count, per binary: u16 name length + name bytes,
+//   u64 tile count, per tile: u32 level, u32 y, u32 x, u32 binary id,
+//   u64 start offset, u64 size
+// Version 2 adds a u64 mask count and the masks, laid out like the tiles.
+// Version 3 follows them with u32 supertile size and the supertiles, again
+// laid out like the tiles. Version 4 ends every entry with u8 1 and the u32
+// CRC-32C of its bytes, or u8 0 and u32 0 when it has none. Each index is
+// written in the lowest version that holds it.
+
+template <typename T> void write_le(std::string &out, T value) {
+  char bytes[sizeof(T)];
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    bytes[i] = static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) &
+                                 0xff);
+  }
+  out.append(bytes, sizeof(T));
+}
+
+template <typename T> T read_le(std::istream &in) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    int byte = in.get();
+    if (byte == EOF) {
+      throw std::runtime_error("Truncated binary index");
+    }
+    value |= static_cast<uint64_t>(byte & 0xff) << (8 * i);
+  }
+  return static_cast<T>(value);
+}
+
+void write_binary_index(std::ostream &stream, const TileIndex &index) {
+  std::vector<std::string> binaries;
+  std::unordered_map<std::string, uint32_t> binary_ids;
+  for (const auto *tiles : {&index.tiles, &index.masks, &index.supertiles}) {
+    for (const auto &tile : *tiles) {
+      if ((binaries.empty() || binaries.back() != tile.binary_name) &&
+          binary_ids.emplace(tile.binary_name, binaries.size()).second) {
+        binaries.push_back(tile.binary_name);
+      }
+    }
+  }
+
+  bool checksums = false;
+  for (const auto *tiles : {&index.tiles, &index.masks, &index.supertiles}) {
+    for (const auto &tile : *tiles) {
+      checksums = checksums || tile.crc32c.has_value();
+    }
+  }
+
+  // Built in memory and written at once
+  std::string out("TIDX", 4);
+  out.reserve(64 + 45 * (index.tiles.size() + index.masks.size() +
+                         index.supertiles.size()));
+  uint32_t version = checksums                  ? 4
+                     : !index.supertiles.empty() ? 3
+                     : !index.masks.empty()      ? 2
+                                                 : 1;
+  write_le<uint32_t>(out, version);
+  write_le<uint32_t>(out, index.width);
+  write_le<uint32_t>(out, index.height);
+  write_le<uint32_t>(out, index.tile_size);
+  write_le<uint32_t>(out, binaries.size());
+  for (const auto &name : binaries) {
+    write_le<uint16_t>(out, name.size());
+    out += name;
+  }
+
+  // Neighbouring tiles mostly share a binary, so its id is looked up once
+  const std::string *last_binary = nullptr;
+  uint32_t last_id = 0;
+  auto write_tiles = [&](const std::vector<TileInfo> &tiles) {
+    write_le<uint64_t>(out, tiles.size());
+    for (const auto &tile : tiles) {
+      if (!last_binary || *last_binary != tile.binary_name) {
+        last_binary = &tile.binary_name;
+        last_id = binary_ids.at(tile.binary_name);
+      }
+      int level, y, x;
+      parse_tile_key(tile.key, level, y, x);
+      write_le<uint32_t>(out, level);
+      write_le<uint32_t>(out, y);
+      write_le<uint32_t>(out, x);
+      write_le<uint32_t>(out, last_id);
+      write_le<uint64_t>(out, tile.start_offset);
+      write_le<uint64_t>(out, tile.size);
+      if (version >= 4) {
+        write_le<uint8_t>(out, tile.crc32c ? 1 : 0);
+        write_le<uint32_t>(out, tile.crc32c.value_or(0));
+      }
+    }
+  };
+  write_tiles(index.tiles);
+  if (version >= 2) {
+    write_tiles(index.masks);
+  }
+  if (version >= 3) {
+    write_le<uint32_t>(out, index.supertile_size);
+    write_tiles(index.supertiles);
+  }
+  stream.write(out.data(), out.size());
+}
+
+void write_binary_index(const fs::path &index_path, const TileIndex &index) {
+  std::ofstream out(index_path, std::ios::binary);
+  if (!out) {
+    throw std::runtime_error("Cannot create index file: " +
+                             index_path.string());
+  }
+
+  write_binary_index(out, index);
+
+  if (!out) {
+    throw std::runtime_error("Failed to write index file: " +
+                             index_path.string());
+  }
+}
+
+TileIndex read_binary_index(std::istream &in, const std::string &name) {
+  char magic[4];
+  in.read(magic, 4);
+  if (!in || std::memcmp(magic, "TIDX", 4) != 0) {
+    throw std::runtime_error("Not a binary index: " + name);
+  }
+  uint32_t version = read_le<uint32_t>(in);
+  if (version < 1 || version > 4) {
+    throw std::runtime_error("Unsupported binary index version " +
+                             std::to_string(version) + ": " + name);
+  }
+
+  TileIndex index;
+  index.width = read_le<uint32_t>(in);
+  index.height = read_le<uint32_t>(in);
+  index.tile_size = read_le<uint32_t>(in);
+
+  std::vector<std::string> binaries(read_le<uint32_t>(in));
+  for (auto &name : binaries) {
+    name.resize(read_le<uint16_t>(in));
+    in.read(name.data(), name.size());
+  }
+
+  auto read_tiles = [&](std::vector<TileInfo> &tiles) {
+    tiles.resize(read_le<uint64_t>(in));
+    for (auto &tile : tiles) {
+      int level = read_le<uint32_t>(in);
+      int y = read_le<uint32_t>(in);
+      int x = read_le<uint32_t>(in);
+      uint32_t binary = read_le<uint32_t>(in);
+      if (binary >= binaries.size()) {
+        throw std::runtime_error("Corrupt binary index: " + name);
+      }
+      tile.key = make_tile_key(level, y, x);
+      tile.binary_name = binaries[binary];
+      tile.start_offset = read_le<uint64_t>(in);
+      tile.size = read_le<uint64_t>(in);
+      if (version >= 4) {
+        bool has_crc = read_le<uint8_t>(in) != 0;
+        uint32_t crc = read_le<uint32_t>(in);
+        if (has_crc) {
+          tile.crc32c = crc;
+        }
+      }
+    }
+  };
+  read_tiles(index.tiles);
+  if (version >= 2) {
+    read_tiles(index.masks);
+  }
+  if (version >= 3) {
+    index.supertile_size = read_le<uint32_t>(in);
+    read_tiles(index.supertiles);
+  }
+
+  return index;
+}
+
+TileIndex read_binary_index(const fs::path &index_path) {
+  std::ifstream in(index_path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Cannot open index file: " + index_path.string());
+  }
+  return read_binary_index(in, index_path.string());
+}
+
+VerifyResult verify_output(const fs::path &output_folder) {
+  TileIndex index = read_metadata(output_folder);
+
+  // Check the entries binary by binary in file order, so each binary is
+  // read once from start to end
+  struct Entry {
+    const TileInfo *tile;
+    bool record;
+  };
+  std::map<std::string, std::vector<Entry>> binaries;
+  for (const auto *tiles : {&index.tiles, &index.masks, &index.supertiles}) {
+    for (const auto &tile : *tiles) {
+      binaries[tile.binary_name].push_back(
+          {&tile, tiles == &index.supertiles});
+    }
+  }
+
+  VerifyResult result;
+  for (auto &[name, entries] : binaries) {
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) {
+                return a.tile->start_offset < b.tile->start_offset;
+              });
+    fs::path path = output_folder / name;
+    if (!fs::exists(path)) {
+      result.checked += entries.size();
+      result.damage.push_back({"", name, "binary missing"});
+      continue;
+    }
+
+    MappedFile binary(path);
+    for (const Entry &entry : entries) {
+      const TileInfo &tile = *entry.tile;
+      // Supertile records from before checksums are covered by their tiles
+      if (entry.record && !tile.crc32c) {
+        continue;
+      }
+      ++result.checked;
+      if (tile.start_offset > binary.size() ||
+          tile.size > binary.size() - tile.start_offset) {
+        result.damage.push_back({tile.key, name, "beyond end of binary"});
+        continue;
+      }
+      const char *data = binary.data() + tile.start_offset;
+      result.bytes += tile.size;
+      if (tile.crc32c) {
+        if (crc32c(data, tile.size) != *tile.crc32c) {
+          result.damage.push_back(
+              {tile.key, name,
+               entry.record ? "supertile checksum mismatch"
+                            : "checksum mismatch"});
+        }
+        continue;
+      }
+      // Without a recorded checksum, the CRC-32 in the gzip trailer still
+      // covers the tile
+      try {
+        gzip_decompress(std::vector<char>(data, data + tile.size));
+      } catch (const std::exception &) {
+        result.damage.push_back({tile.key, name, "corrupt gzip data"});
+      }
+    }
+  }
+  return result;
+}
+
+} // namespace tiler
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Tile container format: gzip-compressed tiles concatenated into .binz files,
+// described by metadata.json or by the equivalent compact binary index.
+
+namespace tiler {
+
+namespace fs = std::filesystem;
+
+struct TileInfo {
+  std::string key;
+  std::string binary_name;
+  size_t start_offset;
+  size_t size;
+  // CRC-32C of the stored bytes; missing in outputs written before
+  // checksums were recorded
+  std::optional<uint32_t> crc32c;
+};
+
+// Everything needed to locate the tiles of one tiled image
+struct TileIndex {
+  int width = 0;
+  int height = 0;
+  int tile_size = 0;
+  std::vector<TileInfo> tiles;
+  // Alpha masks of partly transparent tiles, keyed like their tiles
+  std::vector<TileInfo> masks;
+  // With supertiles, every block of supertile_size x supertile_size tiles
+  // of a level is also one record (see SupertileWriter), keyed
+  // <level>_<block row>_<block column>
+  int supertile_size = 0;
+  std::vector<TileInfo> supertiles;
+};
+
+// Destination for the bytes of a binary
+class ByteSink {
+public:
+  virtual ~ByteSink() = default;
+  virtual void write(const char *data, size_t size) = 0;
+};
+
+class StreamSink : public ByteSink {
+public:
+  explicit StreamSink(std::ostream &out) : out_(out) {}
+  void write(const char *data, size_t size) override;
+
+private:
+  std::ostream &out_;
+};
+
+class VectorSink : public ByteSink {
+public:
+  void write(const char *data, size_t size) override {
+    bytes.insert(bytes.end(), data, data + size);
+  }
+
+  std::vector<char> bytes;
+};
+
+// Destination for the tiles of one image, recording where each one went
+class TileSink {
+public:
+  virtual ~TileSink() = default;
+
+  // Store one encoded tile under `key`
+  virtual const TileInfo &add(const std::string &key,
+                              const std::vector<char> &data) = 0;
+
+  // Store the encoded alpha mask of the tile under `key`
+  virtual const TileInfo &add_mask(const std::string &key,
+                                   const std::vector<char> &data) = 0;
+
+  // Store a tile, or with `mask` a mask, that is already gzip-compressed,
+  // e.g. copied from another binary. Writers of binaries store the bytes as
+  // they are; other sinks get the tile decompressed.
+  virtual const TileInfo &add_compressed(const std::string &key,
+                                         const std::vector<char> &compressed,
+                                         bool mask);
+
+  // Called once after the last tile, e.g. to store what is still buffered
+  virtual void finish() {}
+
+  const std::vector<TileInfo> &tiles() const { return tiles_; }
+  const std::vector<TileInfo> &masks() const { return masks_; }
+  const std::vector<TileInfo> &supertiles() const { return supertiles_; }
+
+  // Index of everything stored, for an image of the given geometry
+  TileIndex index(int width, int height, int tile_size) const {
+    return {width,  height, tile_size,       tiles_,
+            masks_, supertile_size_, supertiles_};
+  }
+
+protected:
+  std::vector<TileInfo> tiles_;
+  std::vector<TileInfo> masks_;
+  int supertile_size_ = 0;
+  std::vector<TileInfo> supertiles_;
+};
+
+// Appends gzip-compressed tiles to a binary, each starting at a multiple
+// of `alignment` bytes with zeros padding the gaps
+class TileWriter : public TileSink {
+public:
+  TileWriter(ByteSink &sink, const std::string &binary_name,
+             size_t offset = 0, size_t alignment = 1)
+      : sink_(sink), binary_name_(binary_name), offset_(offset),
+        alignment_(alignment) {}
+
+  const TileInfo &add(const std::string &key,
+                      const std::vector<char> &data) override;
+  const TileInfo &add_mask(const std::string &key,
+                           const std::vector<char> &data) override;
+  const TileInfo &add_compressed(const std::string &key,
+                                 const std::vector<char> &compressed,
+                                 bool mask) override;
+
+  size_t offset() const { return offset_; }
+
+private:
+  TileInfo append(const std::string &key,
+                  const std::vector<char> &compressed);
+
+  ByteSink &sink_;
+  std::string binary_name_;
+  size_t offset_;
+  size_t alignment_;
+};
+
+// Appends tiles to a binary in supertile records, so that a client fetches
+// a block of n x n neighbouring tiles of a level with one range request.
+// Each record is a sub-index followed by the block's gzip-compressed tiles
+// and masks in that order. All integers are little endian:
+//   "STIL", u32 entry count, per entry: u16 row and u16 column within the
+//   block, u8 kind (0 tile, 1 mask), 3 zero bytes, u32 size
+// Tiles must arrive level by level in row order, as dzsave writes them. A
+// block row is buffered until the tiles move past it, so the offsets in the
+// TileInfo returned by add() are only final once finish() has run.
+class SupertileWriter : public TileSink {
+public:
+  SupertileWriter(ByteSink &sink, const std::string &binary_name, int n,
+                  size_t offset = 0);
+
+  const TileInfo &add(const std::string &key,
+                      const std::vector<char> &data) override;
+  const TileInfo &add_mask(const std::string &key,
+                           const std::vector<char> &data) override;
+  const TileInfo &add_compressed(const std::string &key,
+                                 const std::vector<char> &compressed,
+                                 bool mask) override;
+  void finish() override;
+
+  size_t offset() const { return offset_; }
+
+private:
+  struct Pending {
+    int y;
+    int x;
+    bool mask;
+    std::vector<char> compressed;
+    TileInfo *info;
+  };
+
+  const TileInfo &buffer(const std::string &key,
+                         std::vector<char> compressed, bool mask);
+  void flush();
+
+  ByteSink &sink_;
+  std::string binary_name_;
+  size_t offset_;
+  int level_ = -1;
+  int block_row_ = -1;
+  std::vector<Pending> pending_;
+  // Stable storage for the TileInfo handed out before their block is written
+  std::deque<TileInfo> handed_out_;
+};
+
+// Assignment of pyramid levels to the binaries of an output: all in
+// tiles_000.binz (""), one binary per level ("each"), or groups of levels
+// starting at the listed ones ("0,4,8"). Binaries of levels are named after
+// their first level, e.g. tiles_l04.binz. Throws std::runtime_error for a
+// malformed spec.
+class LevelFiles {
+public:
+  explicit LevelFiles(const std::string &spec = "");
+
+  std::string binary_name(int level) const;
+
+private:
+  bool each_ = false;
+  std::vector<int> starts_;
+};
+
+// Appends the tiles of one output to the binaries of its folder, routed by
+// level as `levels` assigns them and in supertile records of n x n tiles
+// when n is set, otherwise aligned as TileWriter does. A binary is
+// created, or with `append` extended, when its first tile arrives. tiles()
+// and the other lists are filled by finish().
+class LevelTileWriter : public TileSink {
+public:
+  LevelTileWriter(const fs::path &folder, const LevelFiles &levels,
+                  int supertile = 0, bool append = false,
+                  size_t alignment = 1);
+
+  const TileInfo &add(const std::string &key,
+                      const std::vector<char> &data) override;
+  const TileInfo &add_mask(const std::string &key,
+                           const std::vector<char> &data) override;
+  const TileInfo &add_compressed(const std::string &key,
+                                 const std::vector<char> &compressed,
+                                 bool mask) override;
+  void finish() override;
+
+  // Push what was written so far to the binaries on disk
+  void flush();
+
+private:
+  struct Binary {
+    fs::path path;
+    std::ofstream file;
+    std::unique_ptr<StreamSink> sink;
+    std::unique_ptr<TileSink> writer;
+  };
+
+  TileSink &writer_for(int level);
+
+  fs::path folder_;
+  LevelFiles levels_;
+  int supertile_;
+  bool append_;
+  size_t alignment_;
+  std::map<std::string, Binary> binaries_;
+};
+
+// `level` runs from 1 (fastest) to 9 (smallest); -1 is zlib's default
+std::vector<char> gzip_compress(const std::vector<char> &data,
+                                int level = -1);
+std::vector<char> gzip_decompress(const std::vector<char> &data);
+
+// Read-only view of a whole file, memory-mapped where the platform allows
+// and read into memory otherwise
+class MappedFile {
+public:
+  explicit MappedFile(const fs::path &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::vector<char> buffer_;
+};
+
+std::vector<char> read_file(const fs::path &path);
+std::vector<char> read_file_range(const fs::path &path, size_t offset,
+                                  size_t size);
+
+std::string make_tile_key(int level, int y, int x);
+void parse_tile_key(const std::string &key, int &level, int &y, int &x);
+
+void write_metadata(const fs::path &output_folder, int width, int height,
+                    int tile_size, const std::vector<TileInfo> &tiles_map,
+                    const std::vector<TileInfo> &masks = {});
+void write_metadata(std::ostream &out, const TileIndex &index);
+// Writes metadata.json and, when the tiles are spread over level binaries,
+// the binary index of each binary's own tiles next to it, e.g.
+// tiles_l04.idx for tiles_l04.binz
+void write_metadata(const fs::path &output_folder, const TileIndex &index);
+TileIndex read_metadata(const fs::path &output_folder);
+TileIndex read_metadata(std::istream &in, const std::string &name);
+
+// A tile, mask or supertile record of an output that failed verification
+struct TileDamage {
+  std::string key;
+  std::string binary_name;
+  std::string problem;
+};
+
+// Check every tile, mask and supertile record listed in metadata.json of an
+// output against its binaries: the byte range must lie inside the binary
+// and match its CRC-32C, or for tiles without one, decompress cleanly.
+// Throws if the index cannot be read.
+struct VerifyResult {
+  size_t checked = 0;
+  size_t bytes = 0;
+  std::vector<TileDamage> damage;
+};
+VerifyResult verify_output(const fs::path &output_folder);
+
+void write_binary_index(const fs::path &index_path, const TileIndex &index);
+void write_binary_index(std::ostream &out, const TileIndex &index);
+TileIndex read_binary_index(const fs::path &index_path);
+TileIndex read_binary_index(std::istream &in, const std::string &name);
+
+} // namespace tiler
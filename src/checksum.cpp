@@ -0,0 +1,111 @@
+#include "checksum.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define TILER_CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define TILER_CRC32C_ARM 1
+#endif
+
+namespace tiler {
+
+namespace {
+
+constexpr uint32_t kPolynomial = 0x82f63b78; // reflected Castagnoli
+
+// Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero
+// bytes
+struct Tables {
+  std::array<std::array<uint32_t, 256>, 8> table;
+
+  Tables() {
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t crc = b;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (crc & 1 ? kPolynomial : 0);
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (size_t k = 1; k < 8; ++k) {
+        table[k][b] =
+            (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+      }
+    }
+  }
+};
+
+uint32_t crc32c_table(const unsigned char *p, size_t size, uint32_t crc) {
+  static const Tables tables;
+  const auto &t = tables.table;
+  while (size >= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    word ^= crc; // little endian: the CRC overlays the first four bytes
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+          t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+          t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+          t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    p += 8;
+    size -= 8;
+  }
+  while (size-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#if TILER_CRC32C_SSE42
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(const unsigned char *p, size_t size, uint32_t crc) {
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    size -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+  while (size-- > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#elif TILER_CRC32C_ARM
+uint32_t crc32c_arm(const unsigned char *p, size_t size, uint32_t crc) {
+  while (size >= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc = __crc32cd(crc, word);
+    p += 8;
+    size -= 8;
+  }
+  while (size-- > 0) {
+    crc = __crc32cb(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+} // namespace
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc) {
+  const auto *p = static_cast<const unsigned char *>(data);
+  crc = ~crc;
+#if TILER_CRC32C_SSE42
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  crc = has_sse42 ? crc32c_sse42(p, size, crc) : crc32c_table(p, size, crc);
+#elif TILER_CRC32C_ARM
+  crc = crc32c_arm(p, size, crc);
+#else
+  crc = crc32c_table(p, size, crc);
+#endif
+  return ~crc;
+}
+
+} // namespace tiler
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Checksums stored in tile indexes to detect damaged tiles.
+
+namespace tiler {
+
+// CRC-32C (Castagnoli) of `size` bytes, continuing from `crc` to checksum
+// data in pieces. Uses the CRC instructions of SSE 4.2 or ARMv8 when the
+// CPU has them, and a table otherwise.
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+} // namespace tiler
@@ -0,0 +1,179 @@
+#include "inspect.hpp"
+#include "checksum.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_set>
+#include <vips/vips8>
+
+namespace tiler {
+
+void OutputStats::merge(const OutputStats &other) {
+  outputs += other.outputs;
+  binaries += other.binaries;
+  for (const auto &[level, stats] : other.levels) {
+    LevelStats &total = levels[level];
+    total.tiles += stats.tiles;
+    total.masks += stats.masks;
+    total.stored_bytes += stats.stored_bytes;
+    total.raw_bytes += stats.raw_bytes;
+  }
+  for (size_t k = 0; k < size_histogram.size(); ++k) {
+    size_histogram[k] += other.size_histogram[k];
+  }
+  duplicate_tiles += other.duplicate_tiles;
+  duplicate_bytes += other.duplicate_bytes;
+  shared_tiles += other.shared_tiles;
+  blank_tiles += other.blank_tiles;
+  supertiles += other.supertiles;
+  binary_bytes += other.binary_bytes;
+  dead_bytes += other.dead_bytes;
+  neighbours += other.neighbours;
+  ordered_neighbours += other.ordered_neighbours;
+  gaps += other.gaps;
+}
+
+namespace {
+
+// Uncompressed size recorded in the trailer of a gzip member (modulo 4 GiB)
+uint32_t gzip_size(const char *data, size_t size) {
+  if (size < 18) {
+    return 0;
+  }
+  const auto *trailer = reinterpret_cast<const unsigned char *>(data) + size;
+  return trailer[-4] | trailer[-3] << 8 | trailer[-2] << 16 |
+         static_cast<uint32_t>(trailer[-1]) << 24;
+}
+
+bool is_blank(const std::vector<char> &encoded) {
+  vips::VImage image =
+      vips::VImage::new_from_buffer(encoded.data(), encoded.size(), "");
+  return image.min() == image.max();
+}
+
+} // namespace
+
+OutputStats inspect_output(const fs::path &path, bool decode) {
+  bool is_index = fs::is_regular_file(path);
+  fs::path folder = is_index ? path.parent_path() : path;
+  TileIndex index = is_index ? read_binary_index(path) : read_metadata(path);
+
+  OutputStats stats;
+  stats.outputs = 1;
+  stats.supertiles = index.supertiles.size();
+
+  struct Entry {
+    const TileInfo *tile;
+    int level, y, x;
+    bool mask;
+  };
+  std::map<std::string, std::vector<Entry>> binaries;
+  for (const auto *tiles : {&index.tiles, &index.masks}) {
+    for (const auto &tile : *tiles) {
+      Entry entry{&tile, 0, 0, 0, tiles == &index.masks};
+      parse_tile_key(tile.key, entry.level, entry.y, entry.x);
+      binaries[tile.binary_name].push_back(entry);
+    }
+  }
+  for (const auto &record : index.supertiles) {
+    binaries[record.binary_name];
+  }
+
+  std::unordered_set<uint64_t> seen;
+  for (auto &[name, entries] : binaries) {
+    fs::path binary_path = folder / name;
+    if (!fs::exists(binary_path)) {
+      throw std::runtime_error("Binary missing: " + binary_path.string());
+    }
+    MappedFile binary(binary_path);
+    ++stats.binaries;
+    stats.binary_bytes += binary.size();
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) {
+                return a.tile->start_offset < b.tile->start_offset;
+              });
+
+    // Byte ranges in use, records included, to find the dead ones
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (const auto &record : index.supertiles) {
+      if (record.binary_name == name) {
+        ranges.emplace_back(record.start_offset,
+                            record.start_offset + record.size);
+      }
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const Entry &entry = entries[i];
+      const TileInfo &tile = *entry.tile;
+      if (tile.start_offset > binary.size() ||
+          tile.size > binary.size() - tile.start_offset) {
+        throw std::runtime_error("Tile " + tile.key +
+                                 " lies beyond the end of " +
+                                 binary_path.string());
+      }
+      const char *data = binary.data() + tile.start_offset;
+      ranges.emplace_back(tile.start_offset, tile.start_offset + tile.size);
+
+      LevelStats &level = stats.levels[entry.level];
+      (entry.mask ? level.masks : level.tiles) += 1;
+      level.stored_bytes += tile.size;
+      level.raw_bytes += gzip_size(data, tile.size);
+
+      size_t bucket = 0;
+      while (bucket + 1 < stats.size_histogram.size() &&
+             (size_t(2) << bucket) <= tile.size) {
+        ++bucket;
+      }
+      ++stats.size_histogram[bucket];
+
+      // Deduplicated tiles point at the bytes of the tile stored before
+      if (i > 0 && entries[i - 1].tile->start_offset == tile.start_offset) {
+        ++stats.shared_tiles;
+        continue;
+      }
+
+      if (!entry.mask) {
+        uint32_t crc = tile.crc32c ? *tile.crc32c : crc32c(data, tile.size);
+        if (!seen.insert(static_cast<uint64_t>(crc) << 32 ^ tile.size)
+                 .second) {
+          ++stats.duplicate_tiles;
+          stats.duplicate_bytes += tile.size;
+        }
+        if (decode && is_blank(gzip_decompress(
+                          std::vector<char>(data, data + tile.size)))) {
+          ++stats.blank_tiles;
+        }
+      }
+
+      if (i > 0) {
+        const Entry &previous = entries[i - 1];
+        const TileInfo &before = *previous.tile;
+        ++stats.neighbours;
+        // A mask directly follows its tile in pyramid order
+        if (std::tie(previous.level, previous.y, previous.x, previous.mask) <
+            std::tie(entry.level, entry.y, entry.x, entry.mask)) {
+          ++stats.ordered_neighbours;
+        }
+        if (before.start_offset + before.size != tile.start_offset) {
+          ++stats.gaps;
+        }
+      }
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+    size_t used = 0;
+    size_t end = 0;
+    for (const auto &[first, last] : ranges) {
+      if (last > end) {
+        used += last - std::max(first, end);
+        end = last;
+      }
+    }
+    stats.dead_bytes += binary.size() - std::min(used, binary.size());
+  }
+  return stats;
+}
+
+} // namespace tiler
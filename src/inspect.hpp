@@ -0,0 +1,59 @@
+#pragma once
+
+#include "binz.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+// Storage statistics of tiled outputs, to see where the bytes of a binz
+// archive go.
+
+namespace tiler {
+
+struct LevelStats {
+  size_t tiles = 0;
+  size_t masks = 0;
+  // gzip bytes as stored, and the encoded tile bytes they expand to
+  uint64_t stored_bytes = 0;
+  uint64_t raw_bytes = 0;
+};
+
+// Statistics of one output, or summed over several with merge()
+struct OutputStats {
+  size_t outputs = 0;
+  size_t binaries = 0;
+  std::map<int, LevelStats> levels;
+  // Tiles and masks by stored size: entry k counts sizes in [2^k, 2^(k+1))
+  std::array<size_t, 40> size_histogram{};
+  // Tiles whose stored bytes repeat an earlier tile of the same output, by
+  // CRC-32C and size, and the bytes the repeats take
+  size_t duplicate_tiles = 0;
+  uint64_t duplicate_bytes = 0;
+  // Tiles listed at the same bytes as another, as repack --dedupe stores
+  // them
+  size_t shared_tiles = 0;
+  // Tiles of a single colour; only counted when tiles are decoded
+  size_t blank_tiles = 0;
+  size_t supertiles = 0;
+  uint64_t binary_bytes = 0;
+  // Bytes of the binaries that no tile, mask or record covers, such as
+  // tiles replaced by --update
+  uint64_t dead_bytes = 0;
+  // Consecutive tiles and masks in a binary, the pairs of them stored in
+  // level, row and column order, and the pairs with a gap between them
+  size_t neighbours = 0;
+  size_t ordered_neighbours = 0;
+  size_t gaps = 0;
+
+  void merge(const OutputStats &other);
+};
+
+// Statistics of the output at `path`: an output folder, read through its
+// metadata.json, or a binary index (.idx) whose binaries lie next to it.
+// Binaries are memory-mapped; only the gzip trailers of tiles are read,
+// unless `decode` has every tile decoded to find blank ones.
+OutputStats inspect_output(const fs::path &path, bool decode = false);
+
+} // namespace tiler
@@ -1,54 +1,97 @@
 #include <algorithm>
 #include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <future>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <mutex>
+#include <optional>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 #include <vips/vips8>
-#include <zlib.h>
 
-namespace fs = std::filesystem;
+#include "archive.hpp"
+#include "inspect.hpp"
+#include "repack.hpp"
+#include "tile_cache.hpp"
+#include "tiler.hpp"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <arpa/inet.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 using namespace vips;
+using namespace tiler;
 
-struct Config {
+// Command line configuration; the tiling options themselves are shared with
+// the library
+struct Config : TilerOptions {
   std::string inputs_file;
   std::string outputs_file;
   int tile_size = 512;
   std::string suffix = ".jpg";
   int jpeg_quality = 85;
   unsigned int threads = 0;
-  bool keep_tiles = false;
-};
-
-struct ImageTask {
-  std::string input_path;
-  std::string output_path;
-  size_t index;
+  std::string dedupe = "off";
+  unsigned int shard_index = 0;
+  unsigned int shard_count = 1;
+  std::string shard_mode = "hash";
+  std::string report_file;
+  bool queue = false;
+  std::string queue_dir;
+  unsigned int lease_seconds = 300;
+  int region = -1;
+  bool stitch_only = false;
+  std::string daemon_socket;
+  std::string watch_dir;
+  std::string output_template;
+  bool stream = false;
+  int serve_port = 0;
+  // IPv4 address --serve listens on; loopback unless asked otherwise, since
+  // the server renders, and with --write-back writes, for anyone
+  std::string serve_bind = "127.0.0.1";
+  size_t tile_cache_mb = 256;
+  size_t raw_cache_mb = 64;
+  bool write_back = false;
 };
 
-struct ProcessResult {
-  size_t index;
-  bool success;
-  std::string error_message;
-  int width;
-  int height;
-};
-
-struct TileInfo {
-  std::string key;
-  std::string binary_name;
-  size_t start_offset;
-  size_t size;
-};
+std::mutex console_mutex;
 
-std::mutex cout_mutex;
-std::atomic<size_t> completed_count{0};
+// Progress printer handed to the tiler by the command line modes
+void print_progress(const std::string &line, bool error) {
+  std::lock_guard<std::mutex> lock(console_mutex);
+  (error ? std::cerr : std::cout) << line << std::endl;
+}
 
 void print_usage(const char *program_name) {
   std::cerr << "Usage: " << program_name << " [OPTIONS]\n\n"
@@ -60,14 +103,209 @@ void print_usage(const char *program_name) {
                "(one per line)\n\n"
             << "Optional arguments:\n"
             << "  --tile-size <int>      Tile size (default: 512)\n"
-            << "  --suffix <ext>         Tile format: .png, .jpg, .jpeg "
+            << "  --suffix <ext>         Tile format: .png, .jpg, .jpeg, .webp "
                "(default: .jpg)\n"
-            << "  --jpeg-quality <int>   JPEG quality 1-100 (default: 85)\n"
+            << "  --jpeg-quality <int>   JPEG/WebP quality 1-100 "
+               "(default: 85)\n"
+            << "  --kernel <name>        Resize kernel: nearest, linear, "
+               "cubic, mitchell,\n"
+            << "                         lanczos2, lanczos3 (default: "
+               "lanczos3)\n"
+            << "  --level-shrink <mode>  Shrink for coarser pyramid levels: "
+               "mean, median,\n"
+            << "                         mode, max, min, nearest (default: "
+               "mean)\n"
+            << "  --normalize <mode>     Convert to 8-bit sRGB after decode: "
+               "off, srgb, icc\n"
+            << "                         (default: off)\n"
+            << "  --alpha <mode>         keep, or mask: JPEG tiles of images "
+               "with alpha plus\n"
+            << "                         PNG masks for partly transparent "
+               "tiles (default: keep)\n"
+            << "  --levels <min>:<max>   Tile only these pyramid levels (0 is "
+               "the top tile;\n"
+            << "                         either side may be left out)\n"
+            << "  --roi <x>,<y>,<w>,<h>  Tile only the tiles covering this "
+               "source rectangle\n"
+            << "  --variant <spec>       Extra output variant "
+               "<tile-size>:<suffix>:<quality>:<subfolder>\n"
+            << "                         (repeatable; replaces --tile-size/"
+               "--suffix/--jpeg-quality)\n"
+            << "  --variant-cache-mb <int> Max resized image kept in memory "
+               "for variants,\n"
+            << "                         larger ones use a temp file "
+               "(default: 1024)\n"
             << "  --threads <int>        Number of parallel workers (default: "
                "hardware concurrency)\n"
+            << "  --dedupe <mode>        Detect duplicate inputs: off, path, "
+               "content (default: off)\n"
+            << "  --dedupe-link <mode>   Replicate duplicate outputs with: "
+               "copy, hardlink, reflink\n"
+            << "                         (default: copy)\n"
+            << "  --shard <i>/<N>        Process only shard i of N (0-based)\n"
+            << "  --shard-mode <mode>    Shard assignment: hash, range, cost "
+               "(default: hash)\n"
+            << "  --report <file>        Write a JSON Lines run report\n"
+            << "  --queue                Claim tasks through lease files "
+               "shared with other processes\n"
+            << "  --queue-dir <dir>      Lease folder "
+               "(default: <inputs>.claims)\n"
+            << "  --lease-seconds <int>  Lease expiry before a task is "
+               "reclaimed (default: 300)\n"
+            << "  --split <N>            Tile each image as NxN regions plus a "
+               "stitch step\n"
+            << "                         (N a power of two; coarse JPEG/WebP "
+               "levels are\n"
+            << "                         re-encoded from the region tiles)\n"
+            << "  --region <k>           With --split, tile only region k "
+               "(0 to N*N-1)\n"
+            << "  --stitch               With --split, only join finished "
+               "regions\n"
+            << "  --daemon <socket>      Serve tiling jobs on a Unix domain "
+               "socket instead of\n"
+            << "                         reading --inputs/--outputs\n"
+            << "  --serve <port>         Serve the tiles of the outputs over "
+               "HTTP, rendering\n"
+            << "                         missing ones on demand\n"
+            << "  --serve-bind <addr>    IPv4 address to serve on, e.g. "
+               "0.0.0.0 for all\n"
+            << "                         interfaces (default: 127.0.0.1)\n"
+            << "  --tile-cache-mb <int>  Memory for decompressed and rendered "
+               "tiles kept by\n"
+            << "                         --serve (default: 256)\n"
+            << "  --raw-cache-mb <int>   Memory for stored gzip tiles kept by "
+               "--serve\n"
+            << "                         (default: 64)\n"
+            << "  --write-back           With --serve, append rendered tiles "
+               "to tiles_000.binz\n"
+            << "  --watch <dir>          Tile files as they are written to "
+               "<dir> (Linux)\n"
+            << "  --output-template <t>  Output folder for watched files, "
+               "with {name}, {stem}\n"
+            << "                         and {ext} placeholders\n"
+            << "  --archive <format>     Write each output as one tar or zip "
+               "archive of tiles\n"
+            << "                         and metadata.json\n"
+            << "  --stream               Tile one image read from stdin and "
+               "write an archive of\n"
+            << "                         its tiles to stdout (default "
+               "format: tar)\n"
+            << "  --supertile <N>        Store each NxN block of tiles of a "
+               "level as one\n"
+            << "                         contiguous record in tiles_000.binz\n"
+            << "  --level-files <spec>   Write levels to their own binaries: "
+               "each, or the\n"
+            << "                         first levels of groups (e.g. 0,4,8)\n"
             << "  --keep-tiles           Keep original tile files after "
                "merging (default: false)\n"
-            << "  --help                 Show this help message\n";
+            << "  --update               Retile only the parts of each source "
+               "that changed\n"
+            << "                         since the previous --update run\n"
+            << "  --help                 Show this help message\n\n"
+            << "Subcommands:\n"
+            << "  merge-reports --output <file> <report>...\n"
+            << "                         Combine the run reports of several "
+               "shards\n"
+            << "  index [--force] [--threads <int>] <folder>...\n"
+            << "                         Convert metadata.json of the outputs "
+               "in or below each\n"
+            << "                         folder to the binary index "
+               "metadata.idx\n"
+            << "  inspect [--summary] [--decode] [--threads <int>] "
+               "<folder or .idx>...\n"
+            << "                         Report tile counts, sizes, "
+               "duplicates and dead bytes\n"
+            << "                         of outputs\n"
+            << "  repack [options] <folder>...\n"
+            << "                         Rewrite outputs in another layout: "
+               "--order pyramid|zorder,\n"
+            << "                         --gzip-level <1-9>, --align <bytes>, "
+               "--level-files <spec>,\n"
+            << "                         --supertile <N>, --dedupe, "
+               "--binary-index, --threads <int>\n"
+            << "  verify [--threads <int>] <folder>...\n"
+            << "                         Check every tile of the outputs in "
+               "or below each folder\n"
+            << "                         against its checksum\n";
+}
+
+bool is_supported_suffix(const std::string &suffix) {
+  return suffix == ".png" || suffix == ".jpg" || suffix == ".jpeg" ||
+         suffix == ".webp";
+}
+
+OutputVariant parse_variant(const std::string &spec) {
+  std::vector<std::string> parts;
+  std::stringstream ss(spec);
+  std::string part;
+  while (std::getline(ss, part, ':')) {
+    parts.push_back(part);
+  }
+  if (parts.size() != 4) {
+    throw std::runtime_error(
+        "variant must be <tile-size>:<suffix>:<quality>:<subfolder>: " + spec);
+  }
+
+  OutputVariant variant;
+  variant.tile_size = std::stoi(parts[0]);
+  variant.suffix = parts[1];
+  variant.quality = std::stoi(parts[2]);
+  variant.subfolder = parts[3];
+
+  if (variant.tile_size <= 0) {
+    throw std::runtime_error("variant tile-size must be positive: " + spec);
+  }
+  if (!is_supported_suffix(variant.suffix)) {
+    throw std::runtime_error("variant suffix must be .png, .jpg, .jpeg, or "
+                             ".webp: " +
+                             spec);
+  }
+  if (variant.quality < 1 || variant.quality > 100) {
+    throw std::runtime_error("variant quality must be between 1 and 100: " +
+                             spec);
+  }
+  fs::path subfolder(variant.subfolder);
+  if (variant.subfolder.empty() || subfolder.is_absolute() ||
+      std::find(subfolder.begin(), subfolder.end(), "..") !=
+          subfolder.end()) {
+    throw std::runtime_error(
+        "variant subfolder must be a relative folder name: " + spec);
+  }
+  return variant;
+}
+
+// "<min>:<max>" with either side optional, or a single level
+void parse_levels(const std::string &spec, TileRange &range) {
+  size_t colon = spec.find(':');
+  std::string min = spec.substr(0, colon);
+  std::string max = colon == std::string::npos ? min : spec.substr(colon + 1);
+  range.min_level = min.empty() ? 0 : std::stoi(min);
+  range.max_level = max.empty() ? -1 : std::stoi(max);
+  if (range.min_level < 0 ||
+      (range.max_level >= 0 && range.max_level < range.min_level)) {
+    throw std::runtime_error("levels must be <min>:<max> with 0 <= min <= "
+                             "max: " +
+                             spec);
+  }
+}
+
+// "<x>,<y>,<width>,<height>" in source pixels
+void parse_roi(const std::string &spec, TileRange &range) {
+  std::vector<int> values;
+  std::stringstream ss(spec);
+  std::string part;
+  while (std::getline(ss, part, ',')) {
+    values.push_back(std::stoi(part));
+  }
+  if (values.size() != 4 || values[0] < 0 || values[1] < 0 ||
+      values[2] <= 0 || values[3] <= 0) {
+    throw std::runtime_error(
+        "roi must be <x>,<y>,<width>,<height> with a positive size: " + spec);
+  }
+  range.left = values[0];
+  range.top = values[1];
+  range.width = values[2];
+  range.height = values[3];
 }
 
 Config parse_args(int argc, char *argv[]) {
@@ -103,9 +341,9 @@ Config parse_args(int argc, char *argv[]) {
     } else if (arg == "--suffix") {
       if (i + 1 < argc) {
         config.suffix = argv[++i];
-        if (config.suffix != ".png" && config.suffix != ".jpg" &&
-            config.suffix != ".jpeg") {
-          throw std::runtime_error("suffix must be .png, .jpg, or .jpeg");
+        if (!is_supported_suffix(config.suffix)) {
+          throw std::runtime_error(
+              "suffix must be .png, .jpg, .jpeg, or .webp");
         }
       } else {
         throw std::runtime_error("--suffix requires a value");
@@ -127,24 +365,335 @@ Config parse_args(int argc, char *argv[]) {
       }
     } else if (arg == "--keep-tiles") {
       config.keep_tiles = true;
+    } else if (arg == "--update") {
+      config.update = true;
+    } else if (arg == "--variant") {
+      if (i + 1 < argc) {
+        config.variants.push_back(parse_variant(argv[++i]));
+      } else {
+        throw std::runtime_error("--variant requires a value");
+      }
+    } else if (arg == "--kernel") {
+      if (i + 1 < argc) {
+        config.kernel = argv[++i];
+        if (config.kernel == "lanczos") {
+          config.kernel = "lanczos3";
+        }
+        if (config.kernel != "nearest" && config.kernel != "linear" &&
+            config.kernel != "cubic" && config.kernel != "mitchell" &&
+            config.kernel != "lanczos2" && config.kernel != "lanczos3") {
+          throw std::runtime_error("kernel must be nearest, linear, cubic, "
+                                   "mitchell, lanczos2, or lanczos3");
+        }
+      } else {
+        throw std::runtime_error("--kernel requires a value");
+      }
+    } else if (arg == "--level-shrink") {
+      if (i + 1 < argc) {
+        config.level_shrink = argv[++i];
+        if (config.level_shrink != "mean" && config.level_shrink != "median" &&
+            config.level_shrink != "mode" && config.level_shrink != "max" &&
+            config.level_shrink != "min" && config.level_shrink != "nearest") {
+          throw std::runtime_error("level shrink must be mean, median, mode, "
+                                   "max, min, or nearest");
+        }
+      } else {
+        throw std::runtime_error("--level-shrink requires a value");
+      }
+    } else if (arg == "--normalize") {
+      if (i + 1 < argc) {
+        config.normalize = argv[++i];
+        if (config.normalize != "off" && config.normalize != "srgb" &&
+            config.normalize != "icc") {
+          throw std::runtime_error("normalize must be off, srgb, or icc");
+        }
+      } else {
+        throw std::runtime_error("--normalize requires a value");
+      }
+    } else if (arg == "--alpha") {
+      if (i + 1 < argc) {
+        config.alpha = argv[++i];
+        if (config.alpha != "keep" && config.alpha != "mask") {
+          throw std::runtime_error("alpha must be keep or mask");
+        }
+      } else {
+        throw std::runtime_error("--alpha requires a value");
+      }
+    } else if (arg == "--levels") {
+      if (i + 1 < argc) {
+        parse_levels(argv[++i], config.range);
+      } else {
+        throw std::runtime_error("--levels requires a value");
+      }
+    } else if (arg == "--roi") {
+      if (i + 1 < argc) {
+        parse_roi(argv[++i], config.range);
+      } else {
+        throw std::runtime_error("--roi requires a value");
+      }
+    } else if (arg == "--dedupe") {
+      if (i + 1 < argc) {
+        config.dedupe = argv[++i];
+        if (config.dedupe != "off" && config.dedupe != "path" &&
+            config.dedupe != "content") {
+          throw std::runtime_error("dedupe must be off, path, or content");
+        }
+      } else {
+        throw std::runtime_error("--dedupe requires a value");
+      }
+    } else if (arg == "--dedupe-link") {
+      if (i + 1 < argc) {
+        config.dedupe_link = argv[++i];
+        if (config.dedupe_link != "copy" && config.dedupe_link != "hardlink" &&
+            config.dedupe_link != "reflink") {
+          throw std::runtime_error(
+              "dedupe-link must be copy, hardlink, or reflink");
+        }
+      } else {
+        throw std::runtime_error("--dedupe-link requires a value");
+      }
+    } else if (arg == "--shard") {
+      if (i + 1 < argc) {
+        std::string spec = argv[++i];
+        size_t slash = spec.find('/');
+        if (slash == std::string::npos) {
+          throw std::runtime_error("shard must be <i>/<N>: " + spec);
+        }
+        config.shard_index = std::stoul(spec.substr(0, slash));
+        config.shard_count = std::stoul(spec.substr(slash + 1));
+        if (config.shard_count == 0 ||
+            config.shard_index >= config.shard_count) {
+          throw std::runtime_error("shard index must be below shard count: " +
+                                   spec);
+        }
+      } else {
+        throw std::runtime_error("--shard requires a value");
+      }
+    } else if (arg == "--shard-mode") {
+      if (i + 1 < argc) {
+        config.shard_mode = argv[++i];
+        if (config.shard_mode != "hash" && config.shard_mode != "range" &&
+            config.shard_mode != "cost") {
+          throw std::runtime_error("shard-mode must be hash, range, or cost");
+        }
+      } else {
+        throw std::runtime_error("--shard-mode requires a value");
+      }
+    } else if (arg == "--report") {
+      if (i + 1 < argc) {
+        config.report_file = argv[++i];
+      } else {
+        throw std::runtime_error("--report requires a value");
+      }
+    } else if (arg == "--queue") {
+      config.queue = true;
+    } else if (arg == "--queue-dir") {
+      if (i + 1 < argc) {
+        config.queue_dir = argv[++i];
+        config.queue = true;
+      } else {
+        throw std::runtime_error("--queue-dir requires a value");
+      }
+    } else if (arg == "--lease-seconds") {
+      if (i + 1 < argc) {
+        config.lease_seconds = std::stoul(argv[++i]);
+        if (config.lease_seconds == 0) {
+          throw std::runtime_error("lease-seconds must be positive");
+        }
+      } else {
+        throw std::runtime_error("--lease-seconds requires a value");
+      }
+    } else if (arg == "--split") {
+      if (i + 1 < argc) {
+        config.split = std::stoul(argv[++i]);
+        if (config.split == 0 || (config.split & (config.split - 1)) != 0) {
+          throw std::runtime_error("split must be a power of two");
+        }
+      } else {
+        throw std::runtime_error("--split requires a value");
+      }
+    } else if (arg == "--region") {
+      if (i + 1 < argc) {
+        config.region = std::stoi(argv[++i]);
+        if (config.region < 0) {
+          throw std::runtime_error(
+              "region must be between 0 and split * split - 1");
+        }
+      } else {
+        throw std::runtime_error("--region requires a value");
+      }
+    } else if (arg == "--stitch") {
+      config.stitch_only = true;
+    } else if (arg == "--daemon") {
+      if (i + 1 < argc) {
+        config.daemon_socket = argv[++i];
+      } else {
+        throw std::runtime_error("--daemon requires a value");
+      }
+    } else if (arg == "--watch") {
+      if (i + 1 < argc) {
+        config.watch_dir = argv[++i];
+      } else {
+        throw std::runtime_error("--watch requires a value");
+      }
+    } else if (arg == "--output-template") {
+      if (i + 1 < argc) {
+        config.output_template = argv[++i];
+      } else {
+        throw std::runtime_error("--output-template requires a value");
+      }
+    } else if (arg == "--archive") {
+      if (i + 1 < argc) {
+        config.archive = argv[++i];
+        if (config.archive != "tar" && config.archive != "zip") {
+          throw std::runtime_error("--archive must be tar or zip");
+        }
+      } else {
+        throw std::runtime_error("--archive requires a value");
+      }
+    } else if (arg == "--stream") {
+      config.stream = true;
+    } else if (arg == "--serve") {
+      if (i + 1 < argc) {
+        config.serve_port = std::stoi(argv[++i]);
+        if (config.serve_port <= 0 || config.serve_port > 65535) {
+          throw std::runtime_error("serve port must be between 1 and 65535");
+        }
+      } else {
+        throw std::runtime_error("--serve requires a value");
+      }
+    } else if (arg == "--serve-bind") {
+      if (i + 1 < argc) {
+        config.serve_bind = argv[++i];
+      } else {
+        throw std::runtime_error("--serve-bind requires a value");
+      }
+    } else if (arg == "--tile-cache-mb") {
+      if (i + 1 < argc) {
+        config.tile_cache_mb = std::stoul(argv[++i]);
+      } else {
+        throw std::runtime_error("--tile-cache-mb requires a value");
+      }
+    } else if (arg == "--raw-cache-mb") {
+      if (i + 1 < argc) {
+        config.raw_cache_mb = std::stoul(argv[++i]);
+      } else {
+        throw std::runtime_error("--raw-cache-mb requires a value");
+      }
+    } else if (arg == "--write-back") {
+      config.write_back = true;
+    } else if (arg == "--supertile") {
+      if (i + 1 < argc) {
+        config.supertile = std::stoi(argv[++i]);
+        if (config.supertile < 2 || config.supertile > 256) {
+          throw std::runtime_error("supertile must be between 2 and 256");
+        }
+      } else {
+        throw std::runtime_error("--supertile requires a value");
+      }
+    } else if (arg == "--level-files") {
+      if (i + 1 < argc) {
+        config.level_files = argv[++i];
+        LevelFiles check(config.level_files); // throws if malformed
+      } else {
+        throw std::runtime_error("--level-files requires a value");
+      }
+    } else if (arg == "--variant-cache-mb") {
+      if (i + 1 < argc) {
+        config.variant_cache_mb = std::stoul(argv[++i]);
+      } else {
+        throw std::runtime_error("--variant-cache-mb requires a value");
+      }
     } else {
       throw std::runtime_error("Unknown argument: " + arg);
     }
   }
 
-  if (config.inputs_file.empty()) {
+  // Long-running modes receive their tasks instead of reading a manifest
+  bool needs_manifest = config.daemon_socket.empty() &&
+                        config.watch_dir.empty() && !config.stream;
+  if (needs_manifest && config.inputs_file.empty()) {
     throw std::runtime_error("--inputs is required");
   }
-  if (config.outputs_file.empty()) {
+  if (needs_manifest && config.outputs_file.empty()) {
     throw std::runtime_error("--outputs is required");
   }
 
+  // Without explicit variants, the flat options describe the single output
+  // written straight into the output folder
+  if (config.variants.empty()) {
+    config.variants.push_back(
+        {config.tile_size, config.suffix, config.jpeg_quality, ""});
+  } else {
+    for (size_t i = 0; i < config.variants.size(); ++i) {
+      for (size_t j = i + 1; j < config.variants.size(); ++j) {
+        if (config.variants[i].subfolder == config.variants[j].subfolder) {
+          throw std::runtime_error("variant subfolders must be unique: " +
+                                   config.variants[i].subfolder);
+        }
+      }
+    }
+  }
+
+  if (config.write_back && config.serve_port == 0) {
+    throw std::runtime_error("--write-back requires --serve");
+  }
+  if (config.serve_port > 0 && !config.archive.empty()) {
+    throw std::runtime_error("--serve cannot be combined with --archive");
+  }
+
+  if (!config.watch_dir.empty() && config.output_template.empty()) {
+    throw std::runtime_error("--watch requires --output-template");
+  }
+
+  if (!config.archive.empty() && config.split > 1) {
+    throw std::runtime_error("--archive cannot be combined with --split");
+  }
+  if (config.supertile > 0 && (!config.archive.empty() || config.split > 1)) {
+    throw std::runtime_error("--supertile cannot be combined with --archive "
+                             "or --split");
+  }
+  if (!config.level_files.empty() &&
+      (!config.archive.empty() || config.stream || config.split > 1)) {
+    throw std::runtime_error("--level-files cannot be combined with "
+                             "--archive, --stream or --split");
+  }
+  if (!config.range.whole() && config.split > 1) {
+    throw std::runtime_error("--levels and --roi cannot be combined with "
+                             "--split");
+  }
+  if (config.update &&
+      (!config.archive.empty() || config.split > 1 || !config.range.whole())) {
+    throw std::runtime_error("--update cannot be combined with --archive, "
+                             "--split, --levels or --roi");
+  }
+  if (config.alpha == "mask" && config.split > 1) {
+    throw std::runtime_error("--alpha mask cannot be combined with --split");
+  }
+
+  if ((config.region >= 0 || config.stitch_only) && config.split <= 1) {
+    throw std::runtime_error("--region and --stitch require --split");
+  }
+  if (config.region >= 0 && config.stitch_only) {
+    throw std::runtime_error("--region and --stitch are exclusive");
+  }
+  if (config.region >= static_cast<int>(config.split * config.split)) {
+    throw std::runtime_error("region must be between 0 and split * split - 1");
+  }
+
+  if (config.queue && config.queue_dir.empty()) {
+    config.queue_dir = config.inputs_file + ".claims";
+  }
+
   if (config.threads == 0) {
     config.threads = std::thread::hardware_concurrency();
     if (config.threads == 0)
       config.threads = 4;
   }
 
+  // Only a run report shows the conversion time, so only then is it paid
+  config.time_normalize = !config.report_file.empty();
+
   return config;
 }
 
@@ -173,302 +722,2325 @@ std::vector<ImageTask> read_tasks(const std::string &input_file,
   return tasks;
 }
 
-int next_power_of_2(int n) {
-  if (n <= 0)
-    return 1;
-  int power = 1;
-  while (power < n) {
-    power *= 2;
+// Number of output folders covered by the task list, duplicates included
+size_t count_destinations(const std::vector<ImageTask> &tasks) {
+  size_t total = 0;
+  for (const auto &task : tasks) {
+    total += 1 + task.duplicate_outputs.size();
   }
-  return power;
+  return total;
 }
 
-std::vector<char> gzip_compress(const std::vector<char> &data) {
-  z_stream stream;
-  stream.zalloc = Z_NULL;
-  stream.zfree = Z_NULL;
-  stream.opaque = Z_NULL;
-
-  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
-                   Z_DEFAULT_STRATEGY) != Z_OK) {
-    throw std::runtime_error("Failed to initialize gzip compression");
+uint64_t hash_file(const fs::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot open input file: " + path.string());
   }
 
-  std::vector<char> compressed;
-  compressed.resize(deflateBound(&stream, data.size()));
-
-  stream.avail_in = data.size();
-  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
-  stream.avail_out = compressed.size();
-  stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
-
-  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
-    deflateEnd(&stream);
-    throw std::runtime_error("Failed to compress data");
+  // FNV-1a, 64 bit
+  uint64_t hash = 14695981039346656037ULL;
+  std::vector<char> buffer(1 << 20);
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    std::streamsize count = file.gcount();
+    for (std::streamsize i = 0; i < count; ++i) {
+      hash ^= static_cast<unsigned char>(buffer[i]);
+      hash *= 1099511628211ULL;
+    }
   }
-
-  compressed.resize(stream.total_out);
-  deflateEnd(&stream);
-
-  return compressed;
+  return hash;
 }
 
-std::vector<TileInfo> merge_tiles_to_binary(const fs::path &tile_folder,
-                                            const std::string &binary_name,
-                                            bool keep_tiles) {
-  std::vector<TileInfo> tiles_map;
-  fs::path binary_path = tile_folder / binary_name;
-  std::ofstream binary_file(binary_path, std::ios::binary);
+bool files_equal(const fs::path &a, const fs::path &b) {
+  std::ifstream file_a(a, std::ios::binary);
+  std::ifstream file_b(b, std::ios::binary);
+  std::vector<char> buffer_a(1 << 20), buffer_b(1 << 20);
+  while (file_a && file_b) {
+    file_a.read(buffer_a.data(), buffer_a.size());
+    file_b.read(buffer_b.data(), buffer_b.size());
+    if (file_a.gcount() != file_b.gcount() ||
+        std::memcmp(buffer_a.data(), buffer_b.data(), file_a.gcount()) != 0) {
+      return false;
+    }
+  }
+  return file_a.eof() && file_b.eof();
+}
 
-  if (!binary_file) {
-    throw std::runtime_error("Cannot create binary file: " +
-                             binary_path.string());
+// Fold tasks that share an input into the first task that uses it. With
+// "path" inputs are compared by canonical path, with "content" files of equal
+// size are additionally compared by hash and then byte by byte.
+std::vector<ImageTask> deduplicate_tasks(const std::vector<ImageTask> &tasks,
+                                         const std::string &mode) {
+  if (mode == "off") {
+    return tasks;
   }
 
-  size_t current_offset = 0;
+  std::vector<ImageTask> unique;
+
+  auto fold = [&](ImageTask &primary, const ImageTask &task) {
+    std::vector<std::string> outputs = {task.output_path};
+    outputs.insert(outputs.end(), task.duplicate_outputs.begin(),
+                   task.duplicate_outputs.end());
+    for (const auto &output : outputs) {
+      auto &others = primary.duplicate_outputs;
+      if (output != primary.output_path &&
+          std::find(others.begin(), others.end(), output) == others.end()) {
+        others.push_back(output);
+      }
+    }
+  };
+
+  std::map<std::string, size_t> by_path;
+  for (const auto &task : tasks) {
+    std::error_code ec;
+    std::string key = fs::weakly_canonical(task.input_path, ec).string();
+    if (ec) {
+      key = task.input_path;
+    }
 
-  // Collect all tile files
-  std::vector<fs::path> tile_files;
-  for (const auto &level_entry : fs::directory_iterator(tile_folder)) {
-    if (!level_entry.is_directory())
-      continue;
-    std::string level_name = level_entry.path().filename().string();
-    if (!std::all_of(level_name.begin(), level_name.end(), ::isdigit))
-      continue;
+    auto it = by_path.find(key);
+    if (it != by_path.end()) {
+      fold(unique[it->second], task);
+    } else {
+      by_path[key] = unique.size();
+      unique.push_back(task);
+    }
+  }
+  std::vector<bool> folded(unique.size(), false);
+
+  if (mode == "content") {
+    // Only files that share their size with another input need hashing
+    std::map<uintmax_t, std::vector<size_t>> by_size;
+    for (size_t i = 0; i < unique.size(); ++i) {
+      std::error_code ec;
+      uintmax_t size = fs::file_size(unique[i].input_path, ec);
+      if (!ec) {
+        by_size[size].push_back(i);
+      }
+    }
 
-    for (const auto &y_entry : fs::directory_iterator(level_entry)) {
-      if (!y_entry.is_directory())
+    for (const auto &[size, group] : by_size) {
+      if (group.size() < 2) {
         continue;
-
-      for (const auto &tile_entry : fs::directory_iterator(y_entry)) {
-        if (!tile_entry.is_regular_file())
+      }
+      std::map<uint64_t, std::vector<size_t>> by_hash;
+      for (size_t i : group) {
+        // An input that cannot be read stays a task of its own, so that
+        // processing it reports the error like for any other bad input
+        uint64_t hash;
+        try {
+          hash = hash_file(unique[i].input_path);
+        } catch (const std::exception &) {
           continue;
-        std::string ext = tile_entry.path().extension().string();
-        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-        if (ext == ".png" || ext == ".jpg" || ext == ".jpeg") {
-          tile_files.push_back(tile_entry.path());
+        }
+        auto &candidates = by_hash[hash];
+        for (size_t primary : candidates) {
+          if (files_equal(unique[primary].input_path, unique[i].input_path)) {
+            fold(unique[primary], unique[i]);
+            folded[i] = true;
+            break;
+          }
+        }
+        if (!folded[i]) {
+          candidates.push_back(i);
         }
       }
     }
   }
 
-  // Sort tiles for consistent ordering
-  std::sort(tile_files.begin(), tile_files.end());
-
-  // Process each tile
-  for (const auto &tile_path : tile_files) {
-    // Read tile data
-    std::ifstream tile_file(tile_path, std::ios::binary);
-    std::vector<char> tile_data((std::istreambuf_iterator<char>(tile_file)),
-                                std::istreambuf_iterator<char>());
-    tile_file.close();
-
-    // Compress tile
-    std::vector<char> compressed = gzip_compress(tile_data);
+  std::vector<ImageTask> result;
+  for (size_t i = 0; i < unique.size(); ++i) {
+    if (!folded[i]) {
+      result.push_back(std::move(unique[i]));
+    }
+  }
+  return result;
+}
 
-    // Write to binary file
-    binary_file.write(compressed.data(), compressed.size());
+uint64_t hash_string(const std::string &value) {
+  // FNV-1a, 64 bit
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : value) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 
-    // Extract level, y, x from path
-    fs::path parent = tile_path.parent_path();
-    std::string tile_x = tile_path.stem().string();
-    std::string tile_y = parent.filename().string();
-    std::string level = parent.parent_path().filename().string();
+// Estimated work for a task: the pixels of the square power-of-two image
+// that gets tiled, per variant and per destination. Only the header is read.
+// Throws if the input cannot be read.
+double estimate_cost(const ImageTask &task, const Config &config) {
+  VImage image = VImage::new_from_file(task.input_path.c_str());
+  double side = next_power_of_2(std::max(image.width(), image.height()));
+  return side * side * config.variants.size();
+}
 
-    std::string key = level + "_" + tile_y + "_" + tile_x;
+// Keep the tasks that belong to this process's shard. Every shard reads the
+// same manifest and makes the same decisions, so no coordination is needed.
+// "hash" spreads tasks by input path, "range" takes a contiguous slice and
+// "cost" balances estimated pixel counts with a greedy longest-first split.
+std::vector<ImageTask> select_shard(const std::vector<ImageTask> &tasks,
+                                    const Config &config) {
+  if (config.shard_count <= 1) {
+    return tasks;
+  }
 
-    tiles_map.push_back({key, binary_name, current_offset, compressed.size()});
+  std::vector<unsigned int> owner(tasks.size());
+  if (config.shard_mode == "hash") {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      owner[i] = hash_string(tasks[i].input_path) % config.shard_count;
+    }
+  } else if (config.shard_mode == "range") {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      owner[i] = i * config.shard_count / tasks.size();
+    }
+  } else {
+    // Every shard must see the same costs, so an input that this host
+    // cannot read fails the run instead of getting a weight of its own that
+    // would shift the split against the other shards
+    std::vector<double> costs(tasks.size());
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::string unreadable;
+    std::vector<std::thread> probes;
+    for (unsigned int t = 0; t < config.threads; ++t) {
+      probes.emplace_back([&] {
+        for (size_t i = next++; i < tasks.size(); i = next++) {
+          try {
+            costs[i] = estimate_cost(tasks[i], config) *
+                       (1 + tasks[i].duplicate_outputs.size());
+          } catch (const std::exception &) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (unreadable.empty()) {
+              unreadable = tasks[i].input_path;
+            }
+          }
+        }
+      });
+    }
+    for (auto &probe : probes) {
+      probe.join();
+    }
+    if (!unreadable.empty()) {
+      throw std::runtime_error(
+          "--shard-mode cost cannot read the header of " + unreadable +
+          "; every shard must read all inputs, or use --shard-mode hash");
+    }
 
-    current_offset += compressed.size();
+    std::vector<size_t> order(tasks.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+    std::vector<double> load(config.shard_count, 0);
+    for (size_t i : order) {
+      unsigned int lightest = static_cast<unsigned int>(
+          std::min_element(load.begin(), load.end()) - load.begin());
+      owner[i] = lightest;
+      load[lightest] += costs[i];
+    }
   }
 
-  binary_file.close();
+  std::vector<ImageTask> selected;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    if (owner[i] == config.shard_index) {
+      selected.push_back(tasks[i]);
+    }
+  }
+  return selected;
+}
 
-  // Delete tile directories if not keeping
-  if (!keep_tiles) {
-    for (const auto &entry : fs::directory_iterator(tile_folder)) {
-      if (!entry.is_directory())
-        continue;
-      std::string name = entry.path().filename().string();
-      if (std::all_of(name.begin(), name.end(), ::isdigit)) {
-        fs::remove_all(entry.path());
+std::string json_escape(const std::string &value) {
+  std::string escaped;
+  for (char c : value) {
+    switch (c) {
+    case '"':
+      escaped += "\\\"";
+      break;
+    case '\\':
+      escaped += "\\\\";
+      break;
+    case '\n':
+      escaped += "\\n";
+      break;
+    case '\r':
+      escaped += "\\r";
+      break;
+    case '\t':
+      escaped += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char buffer[8];
+        std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        escaped += buffer;
+      } else {
+        escaped += c;
       }
     }
+  }
+  return escaped;
+}
 
-    // Remove blank.png if exists
-    fs::path blank_png = tile_folder / "blank.png";
-    if (fs::exists(blank_png)) {
-      fs::remove(blank_png);
+// Parse one single-level JSON object such as a run report line. Values are
+// returned as text: strings unescaped, numbers and literals verbatim.
+std::map<std::string, std::string> parse_flat_json(const std::string &line) {
+  std::map<std::string, std::string> fields;
+  size_t pos = 0;
+
+  auto skip_space = [&] {
+    while (pos < line.size() &&
+           std::isspace(static_cast<unsigned char>(line[pos])))
+      ++pos;
+  };
+  auto expect = [&](char c) {
+    skip_space();
+    if (pos >= line.size() || line[pos] != c) {
+      throw std::runtime_error(std::string("Malformed JSON, expected '") + c +
+                               "': " + line);
+    }
+    ++pos;
+  };
+  auto read_string = [&] {
+    expect('"');
+    std::string value;
+    while (pos < line.size() && line[pos] != '"') {
+      char c = line[pos++];
+      if (c == '\\' && pos < line.size()) {
+        char e = line[pos++];
+        switch (e) {
+        case 'n':
+          value += '\n';
+          break;
+        case 'r':
+          value += '\r';
+          break;
+        case 't':
+          value += '\t';
+          break;
+        case 'u':
+          value +=
+              static_cast<char>(std::stoi(line.substr(pos, 4), nullptr, 16));
+          pos += 4;
+          break;
+        default:
+          value += e;
+        }
+      } else {
+        value += c;
+      }
+    }
+    expect('"');
+    return value;
+  };
+
+  expect('{');
+  skip_space();
+  while (pos < line.size() && line[pos] != '}') {
+    std::string key = read_string();
+    expect(':');
+    skip_space();
+    if (pos < line.size() && line[pos] == '"') {
+      fields[key] = read_string();
+    } else {
+      size_t end = line.find_first_of(",}", pos);
+      if (end == std::string::npos) {
+        throw std::runtime_error("Malformed JSON: " + line);
+      }
+      std::string raw = line.substr(pos, end - pos);
+      raw.erase(raw.find_last_not_of(" \t") + 1);
+      fields[key] = raw;
+      pos = end;
+    }
+    skip_space();
+    if (pos < line.size() && line[pos] == ',') {
+      ++pos;
+      skip_space();
     }
   }
-
-  return tiles_map;
+  expect('}');
+  return fields;
 }
 
-void write_metadata(const fs::path &output_folder, int width, int height,
-                    int tile_size, const std::vector<TileInfo> &tiles_map) {
-  fs::path meta_path = output_folder / "metadata.json";
-  std::ofstream meta_file(meta_path);
+void write_report(const std::string &report_file,
+                  const std::vector<ImageTask> &tasks,
+                  const std::vector<ProcessResult> &results,
+                  const Config &config) {
+  std::ofstream report(report_file);
+  if (!report) {
+    throw std::runtime_error("Cannot create report file: " + report_file);
+  }
 
-  if (!meta_file) {
-    throw std::runtime_error("Cannot create metadata file: " +
-                             meta_path.string());
+  std::string shard = std::to_string(config.shard_index) + "/" +
+                      std::to_string(config.shard_count);
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    const auto &task = tasks[i];
+    const auto &result = results[i];
+    std::string part = task.region == kStitchRegion ? "stitch"
+                       : task.region >= 0
+                           ? "region " + std::to_string(task.region)
+                           : "image";
+    report << "{\"index\": " << task.index << ", \"part\": \"" << part
+           << "\", \"input\": \""
+           << json_escape(task.input_path) << "\", \"output\": \""
+           << json_escape(task.output_path)
+           << "\", \"replicas\": " << task.duplicate_outputs.size()
+           << ", \"shard\": \"" << shard << "\", \"success\": "
+           << (result.success ? "true" : "false") << ", \"error\": \""
+           << json_escape(result.error_message)
+           << "\", \"width\": " << result.width
+           << ", \"height\": " << result.height
+           << ", \"tiles\": " << result.tile_count
+           << ", \"kernel\": \"" << config.kernel
+           << "\", \"level_shrink\": \"" << config.level_shrink
+           << "\", \"normalize\": \"" << config.normalize << "\"";
+    if (result.normalize_seconds >= 0) {
+      report << ", \"normalize_seconds\": " << result.normalize_seconds;
+    }
+    report << ", \"seconds\": " << result.seconds << "}\n";
   }
+}
 
-  meta_file << "{\n";
-  meta_file << "  \"width\": " << width << ",\n";
-  meta_file << "  \"height\": " << height << ",\n";
-  meta_file << "  \"tile_size\": " << tile_size << ",\n";
-  meta_file << "  \"tiles\": {\n";
+// Combine the JSON Lines reports written by the shards of one run into a
+// single report ordered by task index, and print a summary. A task (or part
+// of a split image) reported twice, for example after a rerun of a shard,
+// keeps its successful record.
+int merge_reports(int argc, char *argv[]) {
+  std::string output_file;
+  std::vector<std::string> report_files;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--output") {
+      if (i + 1 < argc) {
+        output_file = argv[++i];
+      } else {
+        throw std::runtime_error("--output requires a value");
+      }
+    } else {
+      report_files.push_back(arg);
+    }
+  }
+  if (output_file.empty() || report_files.empty()) {
+    throw std::runtime_error(
+        "merge-reports requires --output <file> and at least one report");
+  }
 
-  for (size_t i = 0; i < tiles_map.size(); ++i) {
-    const auto &tile = tiles_map[i];
-    meta_file << "    \"" << tile.key << "\": {\n";
-    meta_file << "      \"binaryName\": \"" << tile.binary_name << "\",\n";
-    meta_file << "      \"startOffset\": " << tile.start_offset << ",\n";
-    meta_file << "      \"size\": " << tile.size << "\n";
-    meta_file << "    }";
-    if (i < tiles_map.size() - 1) {
-      meta_file << ",";
+  std::map<std::pair<size_t, std::string>, std::pair<std::string, bool>>
+      records;
+  for (const auto &report_file : report_files) {
+    std::ifstream report(report_file);
+    if (!report) {
+      throw std::runtime_error("Cannot open report file: " + report_file);
+    }
+    std::string line;
+    while (std::getline(report, line)) {
+      if (line.empty())
+        continue;
+      auto fields = parse_flat_json(line);
+      std::pair<size_t, std::string> key{std::stoull(fields.at("index")),
+                                         fields.count("part")
+                                             ? fields.at("part")
+                                             : "image"};
+      bool success = fields.at("success") == "true";
+      auto it = records.find(key);
+      if (it == records.end() || (success && !it->second.second)) {
+        records[key] = {line, success};
+      }
     }
-    meta_file << "\n";
   }
 
-  meta_file << "  }\n";
-  meta_file << "}\n";
+  std::ofstream merged(output_file);
+  if (!merged) {
+    throw std::runtime_error("Cannot create report file: " + output_file);
+  }
+  size_t succeeded = 0;
+  double seconds = 0;
+  // Resampling runs fused with tiling, so its cost shows as the time per
+  // output megapixel of each combination of settings. Colour conversion is
+  // also timed on its own where the records measured it.
+  struct KernelCost {
+    size_t tasks = 0;
+    double seconds = 0;
+    double megapixels = 0;
+    size_t normalize_tasks = 0;
+    double normalize_seconds = 0;
+    double normalize_megapixels = 0;
+  };
+  std::map<std::string, KernelCost> kernel_costs;
+  for (const auto &[key, record] : records) {
+    merged << record.first << "\n";
+    auto fields = parse_flat_json(record.first);
+    seconds += std::stod(fields.at("seconds"));
+    if (record.second) {
+      ++succeeded;
+      if (key.second != "stitch") {
+        auto field = [&](const char *name, const char *fallback) {
+          return fields.count(name) ? fields.at(name) : fallback;
+        };
+        std::string kernel = field("kernel", "lanczos3") + "/" +
+                             field("level_shrink", "mean") + ", normalize " +
+                             field("normalize", "off");
+        auto &cost = kernel_costs[kernel];
+        double megapixels = std::stod(fields.at("width")) *
+                            std::stod(fields.at("height")) / 1e6;
+        ++cost.tasks;
+        cost.seconds += std::stod(fields.at("seconds"));
+        cost.megapixels += megapixels;
+        if (fields.count("normalize_seconds")) {
+          ++cost.normalize_tasks;
+          cost.normalize_seconds += std::stod(fields.at("normalize_seconds"));
+          cost.normalize_megapixels += megapixels;
+        }
+      }
+    } else {
+      std::cerr << "[FAILED] " << fields.at("input") << ": "
+                << fields.at("error") << std::endl;
+    }
+  }
 
-  meta_file.close();
+  std::cout << "Merged " << report_files.size() << " reports: "
+            << records.size() << " tasks, " << succeeded << " succeeded, "
+            << (records.size() - succeeded) << " failed, " << seconds
+            << " s of processing" << std::endl;
+  for (const auto &[kernel, cost] : kernel_costs) {
+    std::cout << "  " << kernel << ": " << cost.tasks << " tasks, "
+              << cost.seconds << " s, "
+              << (cost.megapixels > 0 ? cost.seconds / cost.megapixels : 0)
+              << " s per output megapixel" << std::endl;
+    if (cost.normalize_tasks > 0) {
+      std::cout << "    normalize: " << cost.normalize_tasks << " tasks, "
+                << cost.normalize_seconds << " s, "
+                << (cost.normalize_megapixels > 0
+                        ? cost.normalize_seconds / cost.normalize_megapixels
+                        : 0)
+                << " s per output megapixel" << std::endl;
+    }
+  }
+  return succeeded == records.size() ? 0 : 1;
 }
 
-ProcessResult process_image(const ImageTask &task, const Config &config,
-                            size_t total) {
-  ProcessResult result{task.index, false, "", 0, 0};
-
-  try {
-    VImage image = VImage::new_from_file(task.input_path.c_str());
-
-    // Get original dimensions
-    int width = image.width();
-    int height = image.height();
+// Task claims shared by several processes through a folder on a common
+// filesystem. A claim is a lease file created exclusively, so exactly one
+// process wins it. Leases are generation numbered: once <key>.lease.<g> has
+// not been renewed for the lease period, the next claimant may create
+// generation g + 1, which reclaims tasks of crashed workers without ever
+// deleting a lease another process might still hold. Finished tasks get a
+// <key>.done marker. Lease ages compare file times against the local
+// clock, so leases must be much longer than the clock skew between hosts.
+class LeaseQueue {
+public:
+  LeaseQueue(const fs::path &dir, std::chrono::seconds lease)
+      : dir_(dir), lease_(lease) {
+    fs::create_directories(dir_);
+
+    char host[256] = "localhost";
+#ifdef _WIN32
+    if (const char *name = std::getenv("COMPUTERNAME")) {
+      std::snprintf(host, sizeof(host), "%s", name);
+    }
+    owner_ = std::string(host) + ":" + std::to_string(_getpid());
+#else
+    gethostname(host, sizeof(host) - 1);
+    owner_ = std::string(host) + ":" + std::to_string(getpid());
+#endif
 
-    // Calculate target size (next power of 2, square)
-    int max_dim = std::max(width, height);
-    int target_size = next_power_of_2(max_dim);
+    heartbeat_ = std::thread([this] { heartbeat(); });
+  }
 
+  ~LeaseQueue() {
     {
-      std::lock_guard<std::mutex> lock(cout_mutex);
-      std::cout << "[" << task.index + 1 << "] " << task.input_path << ": "
-                << width << "x" << height << " -> " << target_size << "x"
-                << target_size << std::endl;
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
     }
+    wake_.notify_all();
+    heartbeat_.join();
+  }
 
-    // Resize image to square target size
-    image =
-        image.resize(static_cast<double>(target_size) / width,
-                     VImage::option()->set(
-                         "vscale", static_cast<double>(target_size) / height));
+  const std::string &owner() const { return owner_; }
 
-    auto options = VImage::option()
-                       ->set("layout", VIPS_FOREIGN_DZ_LAYOUT_GOOGLE)
-                       ->set("depth", VIPS_FOREIGN_DZ_DEPTH_ONETILE)
-                       ->set("tile_size", config.tile_size)
-                       ->set("skip_blanks", -1)
-                       ->set("suffix", config.suffix.c_str());
+  bool is_done(const std::string &key) const {
+    return fs::exists(done_path(key));
+  }
 
-    // Set JPEG quality if using JPEG format
-    if (config.suffix == ".jpg" || config.suffix == ".jpeg") {
-      options->set("Q", config.jpeg_quality);
+  // Try to take task `key`. Fails if it is done or validly leased.
+  bool try_claim(const std::string &key) {
+    if (is_done(key)) {
+      return false;
     }
 
-    image.dzsave(task.output_path.c_str(), options);
-
-    result.success = true;
-    result.width = target_size;
-    result.height = target_size;
-
-    // Merge tiles to binary
-    {
-      std::lock_guard<std::mutex> lock(cout_mutex);
-      std::cout << "  Merging tiles to binary..." << std::endl;
+    unsigned int generation = 0;
+    while (fs::exists(lease_path(key, generation))) {
+      ++generation;
+    }
+    if (generation > 0 && !expired(lease_path(key, generation - 1))) {
+      return false;
     }
 
-    auto tiles_map = merge_tiles_to_binary(fs::path(task.output_path),
-                                           "tiles_000.binz", config.keep_tiles);
+    fs::path lease = lease_path(key, generation);
+    FILE *file = std::fopen(lease.string().c_str(), "wx");
+    if (!file) {
+      // Another process created this generation first
+      return false;
+    }
+    std::fprintf(file, "%s\n", owner_.c_str());
+    std::fclose(file);
 
-    // Write metadata
-    write_metadata(fs::path(task.output_path), target_size, target_size,
-                   config.tile_size, tiles_map);
+    std::lock_guard<std::mutex> lock(mutex_);
+    held_[key] = lease;
+    return true;
+  }
 
-    size_t current = ++completed_count;
+  // Record the outcome of a claimed task and stop renewing its lease.
+  // Failed tasks are finished too, so they are not retried endlessly.
+  void complete(const std::string &key, bool success,
+                const std::string &error) {
     {
-      std::lock_guard<std::mutex> lock(cout_mutex);
-      std::cout << "[" << current << "/" << total << "] ✓ " << task.input_path
-                << " -> " << task.output_path << " (" << tiles_map.size()
-                << " tiles)" << std::endl;
+      std::lock_guard<std::mutex> lock(mutex_);
+      held_.erase(key);
     }
 
-  } catch (const std::exception &e) {
-    result.error_message = e.what();
+    fs::path done = done_path(key);
+    fs::path temp = done;
+    temp += "." + owner_ + ".tmp";
     {
-      std::lock_guard<std::mutex> lock(cout_mutex);
-      std::cerr << "[ERROR] " << task.input_path << ": " << e.what()
-                << std::endl;
+      std::ofstream marker(temp);
+      marker << (success ? "ok" : "failed\t" + error) << "\t" << owner_
+             << "\n";
     }
+    fs::rename(temp, done);
   }
 
-  return result;
-}
+private:
+  fs::path lease_path(const std::string &key, unsigned int generation) const {
+    return dir_ / (key + ".lease." + std::to_string(generation));
+  }
 
-int main(int argc, char *argv[]) {
-  if (VIPS_INIT(argv[0])) {
-    vips_error_exit(nullptr);
+  fs::path done_path(const std::string &key) const {
+    return dir_ / (key + ".done");
   }
 
-  try {
-    Config config = parse_args(argc, argv);
+  bool expired(const fs::path &lease) const {
+    std::error_code ec;
+    auto written = fs::last_write_time(lease, ec);
+    if (ec) {
+      return false;
+    }
+    return fs::file_time_type::clock::now() - written > lease_;
+  }
 
-    auto tasks = read_tasks(config.inputs_file, config.outputs_file);
+  // Renew every held lease a few times per lease period
+  void heartbeat() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto interval = std::chrono::milliseconds(lease_) / 3;
+    while (!wake_.wait_for(lock, interval, [this] { return stopping_; })) {
+      for (const auto &[key, lease] : held_) {
+        std::error_code ec;
+        fs::last_write_time(lease, fs::file_time_type::clock::now(), ec);
+      }
+    }
+  }
 
-    if (tasks.empty()) {
+  fs::path dir_;
+  std::chrono::seconds lease_;
+  std::string owner_;
+  std::map<std::string, fs::path> held_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::thread heartbeat_;
+};
+
+// Lease name of a task: task_<index>, with _r<k> or _stitch for the parts of
+// a split image
+std::string queue_key(size_t index, int region) {
+  std::string key = "task_" + std::to_string(index);
+  if (region == kStitchRegion) {
+    key += "_stitch";
+  } else if (region >= 0) {
+    key += "_r" + std::to_string(region);
+  }
+  return key;
+}
+
+// Work through the task list together with any other process using the same
+// queue folder. Workers scan the list for claimable tasks, starting at
+// different points, until every task has a done marker; tasks leased by
+// others are revisited so expired leases get picked up. The stitch step of a
+// split image only becomes claimable once all its regions are done. Returns
+// the tasks this process handled and their results.
+std::pair<std::vector<ImageTask>, std::vector<ProcessResult>>
+run_queue(Tiler &tiler, const std::vector<ImageTask> &tasks,
+          const Config &config, size_t total) {
+  LeaseQueue queue(config.queue_dir,
+                   std::chrono::seconds(config.lease_seconds));
+  std::vector<ImageTask> claimed;
+  std::vector<ProcessResult> results;
+  std::mutex results_mutex;
+
+  {
+    std::lock_guard<std::mutex> lock(console_mutex);
+    std::cout << "Queue: " << config.queue_dir << " as " << queue.owner()
+              << std::endl;
+  }
+
+  auto poll = std::chrono::seconds(
+      std::max(1u, std::min(5u, config.lease_seconds / 4)));
+  size_t offset = hash_string(queue.owner()) % tasks.size();
+
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < config.threads; ++t) {
+    workers.emplace_back([&, t] {
+      size_t start = (offset + t * tasks.size() / config.threads) %
+                     tasks.size();
+      try {
+        while (true) {
+          bool pending = false;
+          bool worked = false;
+          for (size_t n = 0; n < tasks.size(); ++n) {
+            const auto &task = tasks[(start + n) % tasks.size()];
+            std::string key = queue_key(task.index, task.region);
+            if (queue.is_done(key)) {
+              continue;
+            }
+            pending = true;
+            if (task.region == kStitchRegion) {
+              bool ready = true;
+              int regions = config.split * config.split;
+              for (int r = 0; r < regions && ready; ++r) {
+                ready = queue.is_done(queue_key(task.index, r));
+              }
+              if (!ready) {
+                continue;
+              }
+            }
+            if (!queue.try_claim(key)) {
+              continue;
+            }
+
+            ProcessResult result =
+                tiler.process(task, total, print_progress);
+            queue.complete(key, result.success, result.error_message);
+            worked = true;
+
+            std::lock_guard<std::mutex> lock(results_mutex);
+            claimed.push_back(task);
+            results.push_back(result);
+          }
+          if (!pending) {
+            break;
+          }
+          if (!worked) {
+            std::this_thread::sleep_for(poll);
+          }
+        }
+      } catch (const std::exception &e) {
+        // Leases this worker still holds expire and are reclaimed
+        std::lock_guard<std::mutex> lock(console_mutex);
+        std::cerr << "[ERROR] queue worker: " << e.what() << std::endl;
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  return {claimed, results};
+}
+
+// Replace each image by its region tasks and stitch task when splitting. Only
+// the stitch task carries duplicate outputs, since it finishes the image.
+std::vector<ImageTask> expand_regions(const std::vector<ImageTask> &tasks,
+                                      const Config &config) {
+  if (config.split <= 1) {
+    return tasks;
+  }
+
+  std::vector<ImageTask> expanded;
+  int regions = config.split * config.split;
+  for (const auto &task : tasks) {
+    if (!config.stitch_only) {
+      for (int region = 0; region < regions; ++region) {
+        if (config.region >= 0 && region != config.region)
+          continue;
+        ImageTask part = task;
+        part.region = region;
+        part.duplicate_outputs.clear();
+        expanded.push_back(part);
+      }
+    }
+    if (config.region < 0) {
+      ImageTask stitch = task;
+      stitch.region = kStitchRegion;
+      expanded.push_back(stitch);
+    }
+  }
+  return expanded;
+}
+
+std::vector<ProcessResult> run_batch(Tiler &tiler,
+                                     const std::vector<ImageTask> &tasks,
+                                     const Config &config, size_t total) {
+  // Process images in parallel using thread pool pattern
+  std::vector<std::future<ProcessResult>> futures;
+  std::vector<ProcessResult> results;
+  futures.reserve(tasks.size());
+  results.reserve(tasks.size());
+
+  for (const auto &task : tasks) {
+    futures.push_back(std::async(std::launch::async, [&tiler, task, total] {
+      return tiler.process(task, total, print_progress);
+    }));
+
+    // Limit concurrent tasks to avoid overwhelming the system
+    if (futures.size() >= config.threads) {
+      results.push_back(futures.front().get());
+      futures.erase(futures.begin());
+    }
+  }
+
+  // Wait for remaining tasks
+  for (auto &future : futures) {
+    results.push_back(future.get());
+  }
+
+  return results;
+}
+
+// Fixed set of threads running submitted jobs in order. The long-running
+// modes keep one for their whole lifetime so threads and libvips caches stay
+// warm between jobs. Destruction finishes the queued jobs first.
+class WorkerPool {
+public:
+  explicit WorkerPool(unsigned int threads) {
+    for (unsigned int t = 0; t < threads; ++t) {
+      threads_.emplace_back([this] { run(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+    }
+    wake_.notify_one();
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> jobs_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+};
+
+#ifndef _WIN32
+std::atomic<bool> stop_requested{false};
+
+void request_stop(int) { stop_requested = true; }
+
+bool read_exact(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t count = ::read(fd, data, size);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+bool write_exact(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t count = ::write(fd, data, size);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    data += count;
+    size -= count;
+  }
+  return true;
+}
+
+constexpr uint32_t kMaxFrameSize = 1u << 20;
+
+// Daemon frames are a 4 byte big endian payload length followed by the
+// payload. Returns false at the end of the stream and for a frame longer
+// than kMaxFrameSize, which also sets `too_large`.
+bool read_frame(int fd, std::string &payload, bool &too_large) {
+  too_large = false;
+  unsigned char header[4];
+  if (!read_exact(fd, reinterpret_cast<char *>(header), 4)) {
+    return false;
+  }
+  uint32_t size = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                  (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+  if (size > kMaxFrameSize) {
+    too_large = true;
+    return false;
+  }
+  payload.resize(size);
+  return read_exact(fd, payload.data(), size);
+}
+
+bool write_frame(int fd, const std::string &payload) {
+  uint32_t size = payload.size();
+  char header[4] = {char(size >> 24), char(size >> 16), char(size >> 8),
+                    char(size)};
+  return write_exact(fd, header, 4) &&
+         write_exact(fd, payload.data(), payload.size());
+}
+
+// One client of the daemon. Jobs of a connection run on the shared pool and
+// write their frames back through it, so writes are serialized here.
+struct DaemonConnection {
+  int fd;
+  std::mutex write_mutex;
+  std::mutex jobs_mutex;
+  std::condition_variable jobs_done;
+  size_t outstanding = 0;
+
+  void send(const std::string &payload) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    write_frame(fd, payload);
+  }
+};
+
+// Read job frames until the client closes its side, then wait for the jobs
+// it submitted before closing. A job frame holds key=value lines: input and
+// output are required, id is echoed back (default: job<n>). Replies are
+// "progress <id> <line>" frames followed by one "done <id> ok tiles=<n>
+// seconds=<s>" or "done <id> error <message>" frame.
+void serve_connection(int fd, WorkerPool &pool, Tiler &tiler) {
+  auto connection = std::make_shared<DaemonConnection>();
+  connection->fd = fd;
+
+  std::string payload;
+  size_t job_number = 0;
+  bool too_large = false;
+  while (read_frame(fd, payload, too_large)) {
+    std::map<std::string, std::string> fields;
+    std::stringstream lines(payload);
+    std::string line;
+    while (std::getline(lines, line)) {
+      size_t equals = line.find('=');
+      if (equals != std::string::npos) {
+        fields[line.substr(0, equals)] = line.substr(equals + 1);
+      }
+    }
+
+    std::string id = fields.count("id") ? fields["id"]
+                                        : "job" + std::to_string(job_number);
+    if (fields["input"].empty() || fields["output"].empty()) {
+      connection->send("done " + id + " error job needs input and output");
+      continue;
+    }
+
+    ImageTask task{fields["input"], fields["output"], job_number++};
+    {
+      std::lock_guard<std::mutex> lock(connection->jobs_mutex);
+      ++connection->outstanding;
+    }
+    pool.submit([connection, task, id, &tiler] {
+      auto progress = [&](const std::string &line, bool error) {
+        print_progress(line, error);
+        connection->send("progress " + id + " " + line);
+      };
+      ProcessResult result = tiler.process(task, 0, progress);
+
+      std::ostringstream done;
+      done << "done " << id << " ";
+      if (result.success) {
+        done << "ok tiles=" << result.tile_count
+             << " seconds=" << result.seconds;
+      } else {
+        done << "error " << result.error_message;
+      }
+      connection->send(done.str());
+
+      std::lock_guard<std::mutex> lock(connection->jobs_mutex);
+      --connection->outstanding;
+      connection->jobs_done.notify_all();
+    });
+  }
+  if (too_large) {
+    // The rest of the stream cannot be framed any more, so the connection
+    // ends here, but the client learns why
+    connection->send("error frame too large (limit " +
+                     std::to_string(kMaxFrameSize) + " bytes)");
+  }
+
+  std::unique_lock<std::mutex> lock(connection->jobs_mutex);
+  connection->jobs_done.wait(lock,
+                             [&] { return connection->outstanding == 0; });
+  ::close(fd);
+}
+
+// Accept clients on a Unix domain socket until SIGINT or SIGTERM. Open
+// connections stop reading new jobs on shutdown and their queued jobs finish.
+int run_daemon(const Config &config) {
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (config.daemon_socket.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + config.daemon_socket);
+  }
+  std::strcpy(address.sun_path, config.daemon_socket.c_str());
+
+  int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    throw std::runtime_error("Cannot create socket");
+  }
+  ::unlink(config.daemon_socket.c_str());
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(listener, 64) < 0) {
+    ::close(listener);
+    throw std::runtime_error("Cannot listen on socket: " +
+                             config.daemon_socket);
+  }
+
+  std::cout << "Daemon listening on " << config.daemon_socket << " with "
+            << config.threads << " workers" << std::endl;
+
+  Tiler tiler(config);
+
+  std::set<int> clients;
+  std::mutex clients_mutex;
+  std::condition_variable clients_done;
+  {
+    WorkerPool pool(config.threads);
+
+    while (!stop_requested) {
+      pollfd ready{listener, POLLIN, 0};
+      if (::poll(&ready, 1, 500) <= 0) {
+        continue;
+      }
+      int client = ::accept(listener, nullptr, nullptr);
+      if (client < 0) {
+        continue;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        clients.insert(client);
+      }
+      std::thread([&, client] {
+        serve_connection(client, pool, tiler);
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        clients.erase(client);
+        clients_done.notify_all();
+      }).detach();
+    }
+
+    std::cout << "Daemon stopping, finishing queued jobs..." << std::endl;
+    std::unique_lock<std::mutex> lock(clients_mutex);
+    for (int client : clients) {
+      ::shutdown(client, SHUT_RD);
+    }
+    clients_done.wait(lock, [&] { return clients.empty(); });
+  }
+
+  ::close(listener);
+  ::unlink(config.daemon_socket.c_str());
+  return 0;
+}
+
+// One output of --serve. Tiles already listed in its metadata.json are read
+// from its binaries; the others are rendered from the source when first
+// requested and, with --write-back, appended to the binary of their level.
+struct ServedOutput {
+  std::string input_path;
+  fs::path folder;
+  size_t variant;
+
+  std::mutex mutex;
+  std::unique_ptr<TileRenderer> renderer;
+  std::map<std::string, TileInfo> tiles;
+  std::map<std::string, TileInfo> masks;
+  int supertile_size = 0;
+  std::vector<TileInfo> supertiles;
+  // Write-back state: the binaries open for appending and the tiles added
+  // since metadata.json was last written
+  std::unique_ptr<LevelTileWriter> writer;
+  size_t unsaved = 0;
+};
+
+// Written tiles are indexed in metadata.json after this many new ones, and
+// when the server stops
+constexpr size_t kWriteBackBatch = 256;
+
+// Collects the encoded tile and mask of one render
+class RenderedTile : public TileSink {
+public:
+  const TileInfo &add(const std::string &key,
+                      const std::vector<char> &data) override {
+    tile = data;
+    tiles_.push_back({key, "", 0, data.size(), std::nullopt});
+    return tiles_.back();
+  }
+
+  const TileInfo &add_mask(const std::string &key,
+                           const std::vector<char> &data) override {
+    mask = data;
+    masks_.push_back({key, "", 0, data.size(), std::nullopt});
+    return masks_.back();
+  }
+
+  std::vector<char> tile;
+  std::vector<char> mask;
+};
+
+// Open the renderer and the stored index of an output on first use
+void open_served_output(ServedOutput &output, const Config &config) {
+  if (output.renderer) {
+    return;
+  }
+  auto renderer =
+      std::make_unique<TileRenderer>(output.input_path, config, output.variant);
+  if (fs::exists(output.folder / "metadata.json")) {
+    TileIndex index = read_metadata(output.folder);
+    if (index.width != renderer->target_size() ||
+        index.tile_size != renderer->variant().tile_size) {
+      throw std::runtime_error(output.folder.string() +
+                               " was tiled with other settings");
+    }
+    for (const auto &tile : index.tiles) {
+      output.tiles[tile.key] = tile;
+    }
+    for (const auto &mask : index.masks) {
+      output.masks[mask.key] = mask;
+    }
+    output.supertile_size = index.supertile_size;
+    output.supertiles = index.supertiles;
+  }
+  output.renderer = std::move(renderer);
+}
+
+// Rewrite metadata.json of an output with the tiles written back so far
+void save_served_output(ServedOutput &output) {
+  if (output.unsaved == 0) {
+    return;
+  }
+  output.writer->flush();
+
+  auto sorted = [](const std::map<std::string, TileInfo> &map) {
+    std::vector<TileInfo> tiles;
+    for (const auto &entry : map) {
+      tiles.push_back(entry.second);
+    }
+    std::sort(tiles.begin(), tiles.end(),
+              [](const TileInfo &a, const TileInfo &b) {
+                int a_level, a_y, a_x, b_level, b_y, b_x;
+                parse_tile_key(a.key, a_level, a_y, a_x);
+                parse_tile_key(b.key, b_level, b_y, b_x);
+                return std::tie(a_level, a_y, a_x) <
+                       std::tie(b_level, b_y, b_x);
+              });
+    return tiles;
+  };
+  int size = output.renderer->target_size();
+  int tile_size = output.renderer->variant().tile_size;
+  write_metadata(output.folder,
+                 {size, size, tile_size, sorted(output.tiles),
+                  sorted(output.masks), output.supertile_size,
+                  output.supertiles});
+  output.unsaved = 0;
+}
+
+// Append a rendered tile and its mask to the binary of an output, unless
+// another request stored it meanwhile
+void write_back(ServedOutput &output, const std::string &key,
+                const RenderedTile &rendered, const Config &config) {
+  if (output.tiles.count(key) || rendered.tiles().empty()) {
+    return;
+  }
+  if (!output.writer) {
+    fs::create_directories(output.folder);
+    output.writer = std::make_unique<LevelTileWriter>(
+        output.folder, LevelFiles(config.level_files), 0, true);
+  }
+
+  TileInfo tile = output.writer->add(key, rendered.tile);
+  std::optional<TileInfo> mask;
+  if (!rendered.masks().empty()) {
+    mask = output.writer->add_mask(key, rendered.mask);
+  }
+  // Stored tiles are read back from the binaries, so the bytes must be
+  // there before the tile is listed
+  output.writer->flush();
+  output.tiles[key] = tile;
+  if (mask) {
+    output.masks[key] = *mask;
+  }
+  if (++output.unsaved >= kWriteBackBatch) {
+    save_served_output(output);
+  }
+}
+
+// A tile body and whether it is still gzip-compressed as stored
+struct ServedTile {
+  TileCache::Tile body;
+  bool gzip = false;
+};
+
+// Everything --serve answers from: outputs by their URL prefix, a cache of
+// stored tiles in their gzip form for clients that accept it, and a cache
+// of decompressed and rendered tiles
+struct TileServer {
+  const Config &config;
+  std::map<std::string, std::unique_ptr<ServedOutput>> outputs;
+  TileCache raw_cache;
+  TileCache cache;
+  CachedTileReader reader;
+
+  TileServer(const Config &config, const std::vector<ImageTask> &tasks)
+      : config(config), raw_cache(config.raw_cache_mb << 20),
+        cache(config.tile_cache_mb << 20), reader(&raw_cache, &cache) {
+    for (const auto &task : tasks) {
+      for (size_t v = 0; v < config.variants.size(); ++v) {
+        fs::path folder =
+            fs::path(task.output_path) / config.variants[v].subfolder;
+        std::string prefix = folder.lexically_normal().generic_string();
+        while (!prefix.empty() && prefix.back() == '/') {
+          prefix.pop_back();
+        }
+        prefix.erase(0, prefix.find_first_not_of('/'));
+
+        auto output = std::make_unique<ServedOutput>();
+        output->input_path = task.input_path;
+        output->folder = folder;
+        output->variant = v;
+        outputs[prefix] = std::move(output);
+      }
+    }
+  }
+
+  // The tile or mask at `path`, "<output>/<level>/<y>/<x><suffix>" or
+  // "<output>/<level>/<y>/<x>.mask.png". No body when there is no such
+  // tile, including tiles dropped as fully transparent.
+  ServedTile fetch(const std::string &path, bool accept_gzip) {
+    // Split off "<level>/<y>/<x>" and the suffix
+    size_t x_slash = path.rfind('/');
+    size_t y_slash = x_slash == std::string::npos || x_slash == 0
+                         ? std::string::npos
+                         : path.rfind('/', x_slash - 1);
+    size_t level_slash = y_slash == std::string::npos || y_slash == 0
+                             ? std::string::npos
+                             : path.rfind('/', y_slash - 1);
+    if (level_slash == std::string::npos) {
+      return {};
+    }
+    auto found = outputs.find(path.substr(0, level_slash));
+    if (found == outputs.end()) {
+      return {};
+    }
+    ServedOutput &output = *found->second;
+
+    int level, y, x;
+    std::string name = path.substr(x_slash + 1);
+    size_t dot = name.find('.');
+    std::string suffix = dot == std::string::npos ? "" : name.substr(dot);
+    try {
+      level = std::stoi(path.substr(level_slash + 1, y_slash - level_slash));
+      y = std::stoi(path.substr(y_slash + 1, x_slash - y_slash));
+      x = std::stoi(name.substr(0, dot));
+    } catch (const std::exception &) {
+      return {};
+    }
+    bool mask = suffix == ".mask.png";
+    if (!mask && suffix != config.variants[output.variant].suffix) {
+      return {};
+    }
+    std::string key = make_tile_key(level, y, x);
+
+    std::unique_lock<std::mutex> lock(output.mutex);
+    open_served_output(output, config);
+    auto &stored = mask ? output.masks : output.tiles;
+    auto tile = stored.find(key);
+    if (tile != stored.end()) {
+      TileInfo info = tile->second;
+      lock.unlock();
+      if (accept_gzip) {
+        return {reader.raw(output.folder, info), true};
+      }
+      return {reader.decoded(output.folder, info), false};
+    }
+    if (mask && output.tiles.count(key)) {
+      // A stored tile without a mask is opaque
+      return {};
+    }
+    lock.unlock();
+
+    // Rendered tiles are cached under their path; an empty entry stands
+    // for no tile
+    if (auto cached = cache.get(path)) {
+      return {cached->empty() ? nullptr : cached, false};
+    }
+
+    RenderedTile rendered;
+    try {
+      output.renderer->render(level, y, x, rendered);
+    } catch (const std::out_of_range &) {
+      return {};
+    }
+    if (config.write_back) {
+      lock.lock();
+      write_back(output, key, rendered, config);
+      lock.unlock();
+    }
+
+    std::string tile_path = path.substr(0, x_slash + 1) + std::to_string(x);
+    auto body = std::make_shared<const std::vector<char>>(rendered.tile);
+    auto mask_body = std::make_shared<const std::vector<char>>(rendered.mask);
+    cache.put(tile_path + config.variants[output.variant].suffix, body);
+    cache.put(tile_path + ".mask.png", mask_body);
+    auto result = mask ? mask_body : body;
+    return {result->empty() ? nullptr : result, false};
+  }
+
+  // Counters of both caches as JSON
+  std::string stats() const {
+    std::ostringstream json;
+    auto write = [&](const char *name, const TileCache &cache) {
+      TileCache::Stats stats = cache.stats();
+      uint64_t lookups = stats.hits + stats.misses;
+      json << "\"" << name << "\": {\"hits\": " << stats.hits
+           << ", \"misses\": " << stats.misses << ", \"hit_rate\": "
+           << (lookups ? double(stats.hits) / lookups : 0.0)
+           << ", \"insertions\": " << stats.insertions
+           << ", \"evictions\": " << stats.evictions
+           << ", \"rejections\": " << stats.rejections
+           << ", \"entries\": " << stats.entries
+           << ", \"bytes\": " << stats.bytes
+           << ", \"capacity\": " << cache.capacity_bytes() << "}";
+    };
+    json << "{";
+    write("raw", raw_cache);
+    json << ", ";
+    write("decoded", cache);
+    json << "}\n";
+    return json.str();
+  }
+
+  void save() {
+    for (auto &entry : outputs) {
+      std::lock_guard<std::mutex> lock(entry.second->mutex);
+      if (entry.second->renderer) {
+        save_served_output(*entry.second);
+      }
+    }
+  }
+};
+
+std::string content_type(const std::string &path) {
+  std::string extension = fs::path(path).extension().string();
+  if (extension == ".jpg" || extension == ".jpeg") {
+    return "image/jpeg";
+  }
+  if (extension == ".png") {
+    return "image/png";
+  }
+  if (extension == ".webp") {
+    return "image/webp";
+  }
+  return "application/octet-stream";
+}
+
+// Answer HTTP/1.1 GET and HEAD requests on one connection until the client
+// closes it or asks to
+void serve_http(int fd, TileServer &server) {
+  std::string buffer;
+  char chunk[4096];
+  while (true) {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if (buffer.size() > 16384) {
+        ::close(fd);
+        return;
+      }
+      ssize_t count = ::read(fd, chunk, sizeof(chunk));
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        ::close(fd);
+        return;
+      }
+      buffer.append(chunk, count);
+    }
+    std::string head = buffer.substr(0, end);
+    buffer.erase(0, end + 4);
+
+    std::istringstream request(head);
+    std::string method, target, version;
+    request >> method >> target >> version;
+    std::string lowered = head;
+    std::transform(lowered.begin(), lowered.end(), lowered.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    bool keep_alive = version == "HTTP/1.1" &&
+                      lowered.find("connection: close") == std::string::npos;
+
+    size_t accept = lowered.find("\naccept-encoding:");
+    bool accept_gzip =
+        accept != std::string::npos &&
+        lowered.substr(accept, lowered.find('\n', accept + 1) - accept)
+                .find("gzip") != std::string::npos;
+
+    std::string status = "200 OK";
+    std::string type;
+    ServedTile tile;
+    std::string path = target.substr(0, target.find('?'));
+    path.erase(0, path.find_first_not_of('/'));
+    if (method != "GET" && method != "HEAD") {
+      status = "405 Method Not Allowed";
+    } else if (path == "_stats") {
+      std::string stats = server.stats();
+      tile.body = std::make_shared<const std::vector<char>>(stats.begin(),
+                                                            stats.end());
+      type = "application/json";
+    } else {
+      try {
+        tile = server.fetch(path, accept_gzip);
+        if (!tile.body) {
+          status = "404 Not Found";
+        }
+        type = content_type(path);
+      } catch (const std::exception &e) {
+        print_progress("[ERROR] " + target + ": " + e.what(), true);
+        status = "500 Internal Server Error";
+      }
+    }
+
+    std::ostringstream response;
+    const TileCache::Tile &body = tile.body;
+    size_t length = body ? body->size() : 0;
+    response << "HTTP/1.1 " << status << "\r\n"
+             << "Content-Length: " << length << "\r\n"
+             << "Connection: " << (keep_alive ? "keep-alive" : "close")
+             << "\r\n";
+    if (body) {
+      response << "Content-Type: " << type << "\r\n"
+               << "Cache-Control: public, max-age=86400\r\n"
+               << "Vary: Accept-Encoding\r\n";
+      if (tile.gzip) {
+        response << "Content-Encoding: gzip\r\n";
+      }
+    }
+    response << "\r\n";
+    std::string header = response.str();
+    if (!write_exact(fd, header.data(), header.size()) ||
+        (body && method == "GET" &&
+         !write_exact(fd, body->data(), body->size())) ||
+        !keep_alive) {
+      ::close(fd);
+      return;
+    }
+  }
+}
+
+// Serve the tiles of every output in the manifest over HTTP until SIGINT or
+// SIGTERM, rendering missing tiles on demand
+int run_serve(const Config &config) {
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  TileServer server(config,
+                    read_tasks(config.inputs_file, config.outputs_file));
+
+  int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    throw std::runtime_error("Cannot create socket");
+  }
+  int reuse = 1;
+  ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(config.serve_port);
+  if (::inet_pton(AF_INET, config.serve_bind.c_str(), &address.sin_addr) !=
+      1) {
+    ::close(listener);
+    throw std::runtime_error("Not an IPv4 address: " + config.serve_bind);
+  }
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(listener, 64) < 0) {
+    ::close(listener);
+    throw std::runtime_error("Cannot listen on " + config.serve_bind + ":" +
+                             std::to_string(config.serve_port));
+  }
+
+  std::cout << "Serving " << server.outputs.size() << " outputs on "
+            << config.serve_bind << ":" << config.serve_port << " with "
+            << config.tile_cache_mb << " MB for tiles and "
+            << config.raw_cache_mb << " MB for stored gzip tiles"
+            << (config.write_back ? ", writing back" : "") << std::endl;
+
+  std::set<int> clients;
+  std::mutex clients_mutex;
+  std::condition_variable clients_done;
+  while (!stop_requested) {
+    pollfd ready{listener, POLLIN, 0};
+    if (::poll(&ready, 1, 500) <= 0) {
+      continue;
+    }
+    int client = ::accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(clients_mutex);
+      clients.insert(client);
+    }
+    std::thread([&, client] {
+      serve_http(client, server);
+      std::lock_guard<std::mutex> lock(clients_mutex);
+      clients.erase(client);
+      clients_done.notify_all();
+    }).detach();
+  }
+
+  std::cout << "Server stopping..." << std::endl;
+  {
+    std::unique_lock<std::mutex> lock(clients_mutex);
+    for (int client : clients) {
+      ::shutdown(client, SHUT_RDWR);
+    }
+    clients_done.wait(lock, [&] { return clients.empty(); });
+  }
+  server.save();
+  std::cout << "Cache counters: " << server.stats() << std::flush;
+
+  ::close(listener);
+  return 0;
+}
+#else
+int run_daemon(const Config &) {
+  throw std::runtime_error("--daemon requires Unix domain sockets");
+}
+
+int run_serve(const Config &) {
+  throw std::runtime_error("--serve requires POSIX sockets");
+}
+#endif
+
+// Output folder for a watched file: {name}, {stem} and {ext} in the template
+// are replaced by the file name, the name without extension and the
+// extension without its dot
+std::string expand_output_template(const std::string &output_template,
+                                   const fs::path &input) {
+  std::string ext = input.extension().string();
+  std::map<std::string, std::string> values = {
+      {"{name}", input.filename().string()},
+      {"{stem}", input.stem().string()},
+      {"{ext}", ext.empty() ? "" : ext.substr(1)}};
+
+  std::string output = output_template;
+  for (const auto &[placeholder, value] : values) {
+    size_t pos = 0;
+    while ((pos = output.find(placeholder, pos)) != std::string::npos) {
+      output.replace(pos, placeholder.size(), value);
+      pos += value.size();
+    }
+  }
+  return output;
+}
+
+// Files being written by other tools (hidden files and partial downloads)
+// are not inputs
+bool is_watch_candidate(const fs::path &path) {
+  std::string name = path.filename().string();
+  std::string ext = path.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return !name.empty() && name[0] != '.' && ext != ".tmp" && ext != ".part" &&
+         ext != ".crdownload";
+}
+
+#ifdef __linux__
+// Tile every file that is closed after writing, or moved into the watched
+// folder, on a warm worker pool until SIGINT or SIGTERM. Files already in
+// the folder whose output has no metadata.json yet are tiled at startup.
+int run_watch(const Config &config) {
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+
+  int watcher = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher < 0 ||
+      inotify_add_watch(watcher, config.watch_dir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    if (watcher >= 0)
+      ::close(watcher);
+    throw std::runtime_error("Cannot watch folder: " + config.watch_dir);
+  }
+
+  std::cout << "Watching " << config.watch_dir << " with " << config.threads
+            << " workers" << std::endl;
+
+  {
+    Tiler tiler(config);
+    // Inputs queued or being tiled, each flagged when it changed again in
+    // the meantime. A file is never tiled twice at once, since both jobs
+    // would write the same output folder; a change during its job makes the
+    // job run once more.
+    std::mutex active_mutex;
+    std::map<std::string, bool> active;
+    WorkerPool pool(config.threads);
+    size_t next_index = 0;
+
+    auto submit = [&](const fs::path &input) {
+      if (!is_watch_candidate(input)) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(active_mutex);
+        auto [it, inserted] = active.emplace(input.string(), false);
+        if (!inserted) {
+          it->second = true;
+          return;
+        }
+      }
+      ImageTask task{input.string(),
+                     expand_output_template(config.output_template, input),
+                     next_index++};
+      pool.submit([task, &tiler, &active_mutex, &active] {
+        while (true) {
+          tiler.process(task, 0, print_progress);
+          std::lock_guard<std::mutex> lock(active_mutex);
+          auto it = active.find(task.input_path);
+          if (!it->second) {
+            active.erase(it);
+            return;
+          }
+          it->second = false;
+        }
+      });
+    };
+
+    for (const auto &entry : fs::directory_iterator(config.watch_dir)) {
+      fs::path output(
+          expand_output_template(config.output_template, entry.path()));
+      output = output / config.variants.front().subfolder /
+               (config.archive.empty() ? "metadata.json"
+                                       : archive_file_name(config.archive));
+      if (entry.is_regular_file() && !fs::exists(output)) {
+        submit(entry.path());
+      }
+    }
+
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (!stop_requested) {
+      pollfd ready{watcher, POLLIN, 0};
+      if (::poll(&ready, 1, 500) <= 0) {
+        continue;
+      }
+      ssize_t length = ::read(watcher, buffer, sizeof(buffer));
+      for (ssize_t offset = 0; offset < length;) {
+        auto *event = reinterpret_cast<inotify_event *>(buffer + offset);
+        if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+          submit(fs::path(config.watch_dir) / event->name);
+        }
+        offset += sizeof(inotify_event) + event->len;
+      }
+    }
+
+    std::cout << "Watch stopping, finishing queued jobs..." << std::endl;
+  }
+
+  ::close(watcher);
+  return 0;
+}
+#else
+int run_watch(const Config &) {
+  throw std::runtime_error("--watch requires inotify (Linux)");
+}
+#endif
+
+// Tile one image read from stdin and write an archive stream to stdout
+// holding <subfolder>/<level>/<y>/<x><suffix>.gz and <subfolder>/
+// metadata.json per variant. Nothing but the archive goes to stdout.
+int run_stream(const Config &config) {
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  // binaryName recorded in metadata.json. Offsets count from the start of
+  // the stream, so consumers keep it as one file under this name.
+  std::string format = config.archive.empty() ? "tar" : config.archive;
+  std::string archive_name = archive_file_name(format);
+
+  Tiler tiler(config);
+  StreamSink out(std::cout);
+  auto archive = make_archive_writer(format, out);
+
+  // A pipe can only be decoded once, so several variants tile a copy of
+  // the input held in memory
+  std::vector<char> input;
+  if (config.variants.size() > 1) {
+    input.assign(std::istreambuf_iterator<char>(std::cin),
+                 std::istreambuf_iterator<char>());
+  }
+
+  for (size_t v = 0; v < config.variants.size(); ++v) {
+    const auto &variant = config.variants[v];
+    std::string prefix =
+        variant.subfolder.empty() ? "" : variant.subfolder + "/";
+    ArchiveTileWriter tiles(*archive, archive_name, prefix, variant.suffix);
+
+    TileIndex index =
+        input.empty()
+            ? tiler.tile_source(VSource::new_from_descriptor(0), tiles, v)
+            : tiler.tile_buffer(input.data(), input.size(), tiles, v);
+    tiles.add_index(index.width, index.height, index.tile_size);
+
+    print_progress("✓ stdin -> " + archive_name + ":" + prefix + " (" +
+                       std::to_string(index.tiles.size()) + " tiles)",
+                   true);
+  }
+
+  archive->finish();
+  std::cout.flush();
+  return 0;
+}
+
+// Output folders named on the command line of a subcommand: each folder
+// holding a metadata.json, or else every folder below it that does, in
+// path order
+std::vector<fs::path> find_outputs(const std::vector<std::string> &paths) {
+  std::vector<fs::path> outputs;
+  for (const auto &path : paths) {
+    if (fs::exists(fs::path(path) / "metadata.json")) {
+      outputs.push_back(path);
+      continue;
+    }
+    if (!fs::is_directory(path)) {
+      throw std::runtime_error("Not an output folder: " + path);
+    }
+    size_t first = outputs.size();
+    for (const auto &entry : fs::recursive_directory_iterator(path)) {
+      if (entry.is_regular_file() &&
+          entry.path().filename() == "metadata.json") {
+        outputs.push_back(entry.path().parent_path());
+      }
+    }
+    std::sort(outputs.begin() + first, outputs.end());
+  }
+  return outputs;
+}
+
+// Run fn(i) for i in [0, count) on `threads` threads
+void parallel_for(size_t count, unsigned int threads,
+                  const std::function<void(size_t)> &fn) {
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < std::max(1u, threads); ++t) {
+    workers.emplace_back([&] {
+      for (size_t i = next++; i < count; i = next++) {
+        fn(i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// Thread count of a subcommand: --threads, or one per core
+unsigned int default_threads() {
+  unsigned int threads = std::thread::hardware_concurrency();
+  return threads == 0 ? 4 : threads;
+}
+
+// Check every tile of the outputs in or below the given folders against its
+// CRC-32C, several outputs at a time, and list the damaged ones. Returns 1
+// when any output is damaged or cannot be read.
+int verify_outputs(int argc, char *argv[]) {
+  unsigned int threads = default_threads();
+  std::vector<std::string> paths;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--threads") {
+      if (i + 1 < argc) {
+        threads = std::stoi(argv[++i]);
+      } else {
+        throw std::runtime_error("--threads requires a value");
+      }
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    throw std::runtime_error("verify requires at least one folder");
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  std::vector<fs::path> outputs = find_outputs(paths);
+  std::mutex mutex;
+  size_t damaged = 0;
+  size_t failed = 0;
+  size_t tiles = 0;
+  size_t bytes = 0;
+  parallel_for(outputs.size(), threads, [&](size_t i) {
+    try {
+      VerifyResult result = verify_output(outputs[i]);
+      std::lock_guard<std::mutex> lock(mutex);
+      tiles += result.checked;
+      bytes += result.bytes;
+      if (!result.damage.empty()) {
+        ++damaged;
+        std::cerr << "[DAMAGED] " << outputs[i].string() << ": "
+                  << result.damage.size() << " of " << result.checked
+                  << " entries\n";
+        for (const auto &damage : result.damage) {
+          std::cerr << "  " << damage.binary_name
+                    << (damage.key.empty() ? "" : " " + damage.key) << ": "
+                    << damage.problem << "\n";
+        }
+      }
+    } catch (const std::exception &e) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++failed;
+      std::cerr << "[ERROR] " << outputs[i].string() << ": " << e.what()
+                << "\n";
+    }
+  });
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  std::cout << "Verified " << outputs.size() << " outputs, " << tiles
+            << " entries, " << bytes / (1024 * 1024) << " MB in " << seconds
+            << " s: " << damaged << " damaged, " << failed << " unreadable"
+            << std::endl;
+  return damaged > 0 || failed > 0 ? 1 : 0;
+}
+
+// Convert metadata.json of the outputs in or below the given folders into
+// the compact binary index metadata.idx next to it, several outputs at a
+// time. Outputs whose metadata.idx is newer than their metadata.json are
+// skipped unless --force is given. Returns 1 when any output fails.
+int index_outputs(int argc, char *argv[]) {
+  unsigned int threads = default_threads();
+  bool force = false;
+  std::vector<std::string> paths;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--threads") {
+      if (i + 1 < argc) {
+        threads = std::stoi(argv[++i]);
+      } else {
+        throw std::runtime_error("--threads requires a value");
+      }
+    } else if (arg == "--force") {
+      force = true;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    throw std::runtime_error("index requires at least one folder");
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  std::vector<fs::path> outputs = find_outputs(paths);
+  std::mutex mutex;
+  size_t converted = 0;
+  size_t skipped = 0;
+  size_t failed = 0;
+  size_t tiles = 0;
+  uint64_t json_bytes = 0;
+  parallel_for(outputs.size(), threads, [&](size_t i) {
+    try {
+      fs::path json = outputs[i] / "metadata.json";
+      fs::path idx = outputs[i] / "metadata.idx";
+      if (!force && fs::exists(idx) &&
+          fs::last_write_time(idx) >= fs::last_write_time(json)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++skipped;
+        return;
+      }
+      uint64_t size = fs::file_size(json);
+      TileIndex index = read_metadata(outputs[i]);
+      // Readers never see a half-written index
+      fs::path temp = idx;
+      temp += ".tmp";
+      write_binary_index(temp, index);
+      fs::rename(temp, idx);
+      std::lock_guard<std::mutex> lock(mutex);
+      ++converted;
+      tiles += index.tiles.size() + index.masks.size() +
+               index.supertiles.size();
+      json_bytes += size;
+    } catch (const std::exception &e) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++failed;
+      std::cerr << "[ERROR] " << outputs[i].string() << ": " << e.what()
+                << "\n";
+    }
+  });
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  std::cout << "Indexed " << converted << " outputs, " << tiles
+            << " entries, " << json_bytes / (1024 * 1024) << " MB of JSON in "
+            << seconds << " s";
+  if (seconds > 0) {
+    std::cout << " (" << json_bytes / (1024.0 * 1024) / seconds << " MB/s)";
+  }
+  std::cout << ": " << skipped << " up to date, " << failed << " failed"
+            << std::endl;
+  return failed > 0 ? 1 : 0;
+}
+
+std::string format_bytes(uint64_t bytes) {
+  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double value = static_cast<double>(bytes);
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < std::size(units)) {
+    value /= 1024;
+    ++unit;
+  }
+  std::ostringstream text;
+  text.setf(std::ios::fixed);
+  text.precision(unit == 0 ? 0 : 1);
+  text << value << " " << units[unit];
+  return text.str();
+}
+
+std::string percent(uint64_t part, uint64_t whole) {
+  std::ostringstream text;
+  text.setf(std::ios::fixed);
+  text.precision(1);
+  text << (whole == 0 ? 0.0 : 100.0 * part / whole) << "%";
+  return text.str();
+}
+
+void print_stats(const std::string &title, const OutputStats &stats,
+                 bool decoded) {
+  size_t tiles = 0;
+  size_t masks = 0;
+  uint64_t stored = 0;
+  uint64_t raw = 0;
+  for (const auto &entry : stats.levels) {
+    tiles += entry.second.tiles;
+    masks += entry.second.masks;
+    stored += entry.second.stored_bytes;
+    raw += entry.second.raw_bytes;
+  }
+
+  std::cout << title << ": " << stats.outputs << " outputs, "
+            << stats.binaries << " binaries, " << tiles << " tiles, "
+            << masks << " masks, " << stats.supertiles
+            << " supertile records\n";
+  std::cout << "  Level      Tiles      Stored         Raw  Ratio\n";
+  auto row = [&](const std::string &label, const LevelStats &level) {
+    std::ostringstream ratio;
+    ratio.setf(std::ios::fixed);
+    ratio.precision(2);
+    ratio << (level.stored_bytes == 0
+                  ? 0.0
+                  : static_cast<double>(level.raw_bytes) / level.stored_bytes);
+    std::cout << "  " << std::left << std::setw(5) << label << std::right
+              << std::setw(11) << level.tiles + level.masks << std::setw(12)
+              << format_bytes(level.stored_bytes) << std::setw(12)
+              << format_bytes(level.raw_bytes) << std::setw(7) << ratio.str()
+              << "\n";
+  };
+  for (const auto &[level, level_stats] : stats.levels) {
+    row(std::to_string(level), level_stats);
+  }
+  row("all", {tiles, masks, stored, raw});
+
+  std::cout << "  Stored sizes:";
+  for (size_t k = 0; k < stats.size_histogram.size(); ++k) {
+    if (stats.size_histogram[k] > 0) {
+      std::cout << " " << (k == 0 ? "<" + format_bytes(2)
+                                  : format_bytes(uint64_t(1) << k) + "+")
+                << ": " << stats.size_histogram[k];
+    }
+  }
+  std::cout << "\n";
+  std::cout << "  Duplicate tiles: " << stats.duplicate_tiles << " ("
+            << format_bytes(stats.duplicate_bytes) << "), "
+            << stats.shared_tiles << " more sharing stored bytes\n";
+  if (decoded) {
+    std::cout << "  Blank tiles: " << stats.blank_tiles << "\n";
+  }
+  std::cout << "  Dead bytes: " << format_bytes(stats.dead_bytes) << " of "
+            << format_bytes(stats.binary_bytes) << " ("
+            << percent(stats.dead_bytes, stats.binary_bytes) << ")\n";
+  std::cout << "  Physical order: "
+            << percent(stats.ordered_neighbours, stats.neighbours)
+            << " of neighbours in level, row and column order, "
+            << stats.gaps << " gaps\n";
+}
+
+// Report where the bytes of the outputs in or below the given folders, or
+// of the given binary indexes, go. Outputs are read in parallel; with
+// --summary only their totals are printed.
+int inspect_outputs(int argc, char *argv[]) {
+  unsigned int threads = default_threads();
+  bool summary = false;
+  bool decode = false;
+  std::vector<std::string> paths;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--threads") {
+      if (i + 1 < argc) {
+        threads = std::stoi(argv[++i]);
+      } else {
+        throw std::runtime_error("--threads requires a value");
+      }
+    } else if (arg == "--summary") {
+      summary = true;
+    } else if (arg == "--decode") {
+      decode = true;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    throw std::runtime_error("inspect requires at least one folder or index");
+  }
+
+  std::vector<fs::path> outputs;
+  std::vector<std::string> folders;
+  for (const auto &path : paths) {
+    if (fs::is_regular_file(path)) {
+      outputs.push_back(path);
+    } else {
+      folders.push_back(path);
+    }
+  }
+  for (const auto &output : find_outputs(folders)) {
+    outputs.push_back(output);
+  }
+
+  std::vector<OutputStats> stats(outputs.size());
+  std::vector<std::string> errors(outputs.size());
+  parallel_for(outputs.size(), threads, [&](size_t i) {
+    try {
+      stats[i] = inspect_output(outputs[i], decode);
+    } catch (const std::exception &e) {
+      errors[i] = e.what();
+    }
+  });
+
+  OutputStats total;
+  size_t failed = 0;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (!errors[i].empty()) {
+      ++failed;
+      std::cerr << "[ERROR] " << outputs[i].string() << ": " << errors[i]
+                << "\n";
+      continue;
+    }
+    if (!summary) {
+      print_stats(outputs[i].string(), stats[i], decode);
+    }
+    total.merge(stats[i]);
+  }
+  if (summary || outputs.size() > 1) {
+    print_stats("Total", total, decode);
+  }
+  std::cout.flush();
+  return failed > 0 ? 1 : 0;
+}
+
+// Rewrite the outputs in or below the given folders into the layout the
+// options ask for, several at a time. Outputs nested in another output are
+// repacked first, so the outer one carries over their new files. Returns 1
+// when any output could not be repacked; those are left as they were.
+int repack_outputs(int argc, char *argv[]) {
+  unsigned int threads = default_threads();
+  RepackOptions options;
+  std::vector<std::string> paths;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error(arg + " requires a value");
+      }
+      return argv[++i];
+    };
+    if (arg == "--threads") {
+      threads = std::stoi(value());
+    } else if (arg == "--order") {
+      options.order = value();
+      if (options.order != "pyramid" && options.order != "zorder") {
+        throw std::runtime_error("order must be pyramid or zorder");
+      }
+    } else if (arg == "--gzip-level") {
+      options.gzip_level = std::stoi(value());
+      if (options.gzip_level < 1 || options.gzip_level > 9) {
+        throw std::runtime_error("gzip level must be between 1 and 9");
+      }
+    } else if (arg == "--align") {
+      options.alignment = std::stoul(value());
+      if (options.alignment < 1) {
+        throw std::runtime_error("alignment must be at least 1");
+      }
+    } else if (arg == "--level-files") {
+      options.level_files = value();
+      LevelFiles check(options.level_files); // throws if malformed
+    } else if (arg == "--supertile") {
+      options.supertile = std::stoi(value());
+      if (options.supertile < 2 || options.supertile > 256) {
+        throw std::runtime_error("supertile must be between 2 and 256");
+      }
+    } else if (arg == "--dedupe") {
+      options.dedupe = true;
+    } else if (arg == "--binary-index") {
+      options.binary_index = true;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    throw std::runtime_error("repack requires at least one folder");
+  }
+  if (options.supertile > 0 && (options.order != "pyramid" ||
+                                options.dedupe || options.alignment > 1)) {
+    throw std::runtime_error("--supertile cannot be combined with "
+                             "--order zorder, --dedupe or --align");
+  }
+
+  std::map<size_t, std::vector<fs::path>, std::greater<size_t>> by_depth;
+  for (const auto &output : find_outputs(paths)) {
+    fs::path absolute = fs::absolute(output).lexically_normal();
+    by_depth[std::distance(absolute.begin(), absolute.end())].push_back(
+        output);
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  std::mutex mutex;
+  size_t repacked = 0;
+  size_t failed = 0;
+  uint64_t before = 0;
+  uint64_t after = 0;
+  for (const auto &[depth, outputs] : by_depth) {
+    parallel_for(outputs.size(), threads, [&](size_t i) {
+      try {
+        RepackResult result = repack_output(outputs[i], options);
+        std::lock_guard<std::mutex> lock(mutex);
+        ++repacked;
+        before += result.bytes_before;
+        after += result.bytes_after;
+        std::cout << "✓ " << outputs[i].string() << ": " << result.tiles
+                  << " tiles";
+        if (options.dedupe) {
+          std::cout << " (" << result.deduplicated << " deduplicated)";
+        }
+        std::cout << ", " << format_bytes(result.bytes_before) << " -> "
+                  << format_bytes(result.bytes_after) << "\n";
+      } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++failed;
+        std::cerr << "[ERROR] " << outputs[i].string() << ": " << e.what()
+                  << "\n";
+      }
+    });
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  std::cout << "Repacked " << repacked << " outputs, " << failed
+            << " failed, " << format_bytes(before) << " -> "
+            << format_bytes(after) << " in " << seconds << " s" << std::endl;
+  return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (VIPS_INIT(argv[0])) {
+    vips_error_exit(nullptr);
+  }
+
+  try {
+    if (argc > 1 && std::string(argv[1]) == "merge-reports") {
+      int status = merge_reports(argc, argv);
+      vips_shutdown();
+      return status;
+    }
+    if (argc > 1 && std::string(argv[1]) == "index") {
+      int status = index_outputs(argc, argv);
+      vips_shutdown();
+      return status;
+    }
+    if (argc > 1 && std::string(argv[1]) == "inspect") {
+      int status = inspect_outputs(argc, argv);
+      vips_shutdown();
+      return status;
+    }
+    if (argc > 1 && std::string(argv[1]) == "repack") {
+      int status = repack_outputs(argc, argv);
+      vips_shutdown();
+      return status;
+    }
+    if (argc > 1 && std::string(argv[1]) == "verify") {
+      int status = verify_outputs(argc, argv);
+      vips_shutdown();
+      return status;
+    }
+
+    Config config = parse_args(argc, argv);
+
+    if (!config.daemon_socket.empty()) {
+      int status = run_daemon(config);
+      vips_shutdown();
+      return status;
+    }
+
+    if (config.serve_port > 0) {
+      int status = run_serve(config);
+      vips_shutdown();
+      return status;
+    }
+
+    if (!config.watch_dir.empty()) {
+      int status = run_watch(config);
+      vips_shutdown();
+      return status;
+    }
+
+    if (config.stream) {
+      int status = run_stream(config);
+      vips_shutdown();
+      return status;
+    }
+
+    auto tasks = deduplicate_tasks(
+        read_tasks(config.inputs_file, config.outputs_file), config.dedupe);
+    tasks = expand_regions(select_shard(tasks, config), config);
+    size_t total = count_destinations(tasks);
+
+    if (tasks.empty()) {
+      if (!config.report_file.empty()) {
+        write_report(config.report_file, tasks, {}, config);
+      }
       std::cout << "No tasks to process." << std::endl;
       vips_shutdown();
       return 0;
     }
 
-    std::cout << "Configuration:\n"
-              << "  Tile size: " << config.tile_size << "\n"
-              << "  Format: " << config.suffix << "\n"
-              << "  JPEG quality: " << config.jpeg_quality << "\n"
-              << "  Threads: " << config.threads << "\n"
+    std::cout << "Configuration:\n";
+    for (const auto &variant : config.variants) {
+      std::cout << "  Variant" << (variant.subfolder.empty() ? "" : " ")
+                << variant.subfolder << ": tile size " << variant.tile_size
+                << ", format " << variant.suffix << ", quality "
+                << variant.quality << "\n";
+    }
+    std::cout << "  Threads: " << config.threads << "\n"
               << "  Keep tiles: " << (config.keep_tiles ? "yes" : "no") << "\n"
-              << "\nProcessing " << tasks.size() << " images...\n"
+              << "  Dedupe: " << config.dedupe << " (" << config.dedupe_link
+              << ")\n"
+              << "  Resampling: " << config.kernel << ", levels "
+              << config.level_shrink << "\n"
+              << "  Normalize: " << config.normalize << "\n"
+              << "  Alpha: " << config.alpha << "\n"
+              << "  Update: " << (config.update ? "yes" : "no") << "\n";
+    if (!config.range.whole()) {
+      const auto &range = config.range;
+      std::cout << "  Levels: " << range.min_level << " to "
+                << (range.max_level < 0 ? std::string("full resolution")
+                                        : std::to_string(range.max_level))
+                << "\n";
+      if (range.width > 0) {
+        std::cout << "  Region of interest: " << range.width << "x"
+                  << range.height << " at " << range.left << ","
+                  << range.top << "\n";
+      }
+    }
+    if (!config.level_files.empty()) {
+      std::cout << "  Level files: " << config.level_files << "\n";
+    }
+    if (config.shard_count > 1) {
+      std::cout << "  Shard: " << config.shard_index << "/"
+                << config.shard_count << " (" << config.shard_mode << ")\n";
+    }
+    std::cout << "\nProcessing " << tasks.size() << " images";
+    if (total > tasks.size()) {
+      std::cout << " for " << total << " outputs";
+    }
+    std::cout << "...\n"
               << std::endl;
 
-    // Process images in parallel using thread pool pattern
-    std::vector<std::future<ProcessResult>> futures;
-    futures.reserve(tasks.size());
+    Tiler tiler(config);
 
-    for (const auto &task : tasks) {
-      futures.push_back(std::async(std::launch::async, process_image, task,
-                                   std::ref(config), tasks.size()));
-
-      // Limit concurrent tasks to avoid overwhelming the system
-      if (futures.size() >= config.threads) {
-        futures.front().wait();
-        futures.erase(futures.begin());
+    if (config.queue) {
+      auto [claimed, results] = run_queue(tiler, tasks, config, total);
+      if (!config.report_file.empty()) {
+        write_report(config.report_file, claimed, results, config);
       }
+
+      size_t failed = std::count_if(
+          results.begin(), results.end(),
+          [](const ProcessResult &result) { return !result.success; });
+      std::cout << "\nQueue drained: this process handled " << claimed.size()
+                << " of " << tasks.size() << " images, " << failed
+                << " failed" << std::endl;
+      vips_shutdown();
+      return failed == 0 ? 0 : 1;
     }
 
-    // Wait for remaining tasks
-    for (auto &future : futures) {
-      future.wait();
+    // Stitch tasks need all regions of their image, so they run last
+    auto first_stitch = std::stable_partition(
+        tasks.begin(), tasks.end(),
+        [](const ImageTask &task) { return task.region != kStitchRegion; });
+    std::vector<ImageTask> regions(tasks.begin(), first_stitch);
+    std::vector<ImageTask> stitches(first_stitch, tasks.end());
+
+    auto results = run_batch(tiler, regions, config, total);
+    auto stitched = run_batch(tiler, stitches, config, total);
+    results.insert(results.end(), stitched.begin(), stitched.end());
+
+    if (!config.report_file.empty()) {
+      write_report(config.report_file, tasks, results, config);
     }
 
-    std::cout << "\nCompleted: " << completed_count.load() << "/"
-              << tasks.size() << " images" << std::endl;
+    std::cout << "\nCompleted: " << tiler.completed() << "/" << total
+              << " images" << std::endl;
 
-    if (completed_count.load() < tasks.size()) {
-      std::cerr << "Warning: " << (tasks.size() - completed_count.load())
+    if (tiler.completed() < total) {
+      std::cerr << "Warning: " << (total - tiler.completed())
                 << " images failed to process" << std::endl;
       vips_shutdown();
       return 1;
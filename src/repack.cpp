@@ -0,0 +1,258 @@
+#include "repack.hpp"
+#include "checksum.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#endif
+
+namespace tiler {
+
+namespace {
+
+// Bits of v spread to the even positions
+uint64_t spread_bits(uint32_t v) {
+  uint64_t x = v;
+  x = (x | x << 16) & 0x0000ffff0000ffffull;
+  x = (x | x << 8) & 0x00ff00ff00ff00ffull;
+  x = (x | x << 4) & 0x0f0f0f0f0f0f0f0full;
+  x = (x | x << 2) & 0x3333333333333333ull;
+  x = (x | x << 1) & 0x5555555555555555ull;
+  return x;
+}
+
+// Files of an output that repacking writes anew
+bool is_repacked_file(const fs::path &path) {
+  std::string name = path.filename().string();
+  std::string extension = path.extension().string();
+  return name == "metadata.json" || name == "metadata.idx" ||
+         (name.rfind("tiles_", 0) == 0 &&
+          (extension == ".binz" || extension == ".idx"));
+}
+
+// Hard-link a file, or copy it where links are not possible
+void link_file(const fs::path &from, const fs::path &to) {
+  std::error_code ec;
+  fs::create_hard_link(from, to, ec);
+  if (ec) {
+    fs::copy_file(from, to);
+  }
+}
+
+void link_tree(const fs::path &from, const fs::path &to) {
+  fs::create_directories(to);
+  for (const auto &entry : fs::directory_iterator(from)) {
+    fs::path target = to / entry.path().filename();
+    if (entry.is_directory()) {
+      link_tree(entry.path(), target);
+    } else if (entry.is_regular_file()) {
+      link_file(entry.path(), target);
+    }
+  }
+}
+
+// Swap two folders, atomically where the filesystem supports it
+void exchange_folders(const fs::path &a, const fs::path &b) {
+#if defined(__linux__) && defined(RENAME_EXCHANGE)
+  if (::renameat2(AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(),
+                  RENAME_EXCHANGE) == 0) {
+    return;
+  }
+#endif
+  fs::path parked = a;
+  parked += ".old";
+  fs::rename(a, parked);
+  fs::rename(b, a);
+  fs::rename(parked, b);
+}
+
+RepackResult write_repacked(const fs::path &folder, const fs::path &staging,
+                            const RepackOptions &options) {
+  TileIndex index = read_metadata(folder);
+  RepackResult result;
+
+  struct Entry {
+    const TileInfo *tile;
+    bool mask;
+    int level, y, x;
+    uint64_t position;
+  };
+  std::vector<Entry> entries;
+  for (const auto *tiles : {&index.tiles, &index.masks}) {
+    for (const auto &tile : *tiles) {
+      Entry entry{&tile, tiles == &index.masks, 0, 0, 0, 0};
+      parse_tile_key(tile.key, entry.level, entry.y, entry.x);
+      entry.position =
+          options.order == "zorder"
+              ? spread_bits(entry.y) << 1 | spread_bits(entry.x)
+              : static_cast<uint64_t>(entry.y) << 32 | uint32_t(entry.x);
+      entries.push_back(entry);
+    }
+  }
+  // A mask follows its tile
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return std::tie(a.level, a.position, a.mask) <
+                     std::tie(b.level, b.position, b.mask);
+            });
+
+  std::map<std::string, std::unique_ptr<MappedFile>> sources;
+  for (const auto *tiles : {&index.tiles, &index.masks, &index.supertiles}) {
+    for (const auto &tile : *tiles) {
+      auto &source = sources[tile.binary_name];
+      if (!source) {
+        source = std::make_unique<MappedFile>(folder / tile.binary_name);
+        result.bytes_before += source->size();
+      }
+    }
+  }
+
+  LevelTileWriter writer(staging, LevelFiles(options.level_files),
+                         options.supertile, false, options.alignment);
+  // First copy of each distinct tile: its stored bytes and where it went
+  struct Stored {
+    const char *data;
+    size_t size;
+    TileInfo info;
+  };
+  std::unordered_multimap<uint64_t, Stored> stored;
+  std::vector<TileInfo> duplicates;
+  for (const Entry &entry : entries) {
+    const TileInfo &tile = *entry.tile;
+    const MappedFile &source = *sources.at(tile.binary_name);
+    if (tile.start_offset > source.size() ||
+        tile.size > source.size() - tile.start_offset) {
+      throw std::runtime_error("Tile " + tile.key +
+                               " lies beyond the end of " + tile.binary_name);
+    }
+    const char *data = source.data() + tile.start_offset;
+    uint32_t crc = crc32c(data, tile.size);
+    std::vector<char> bytes(data, data + tile.size);
+    if (tile.crc32c && crc != *tile.crc32c) {
+      throw std::runtime_error("Checksum mismatch for tile " + tile.key +
+                               " in " + tile.binary_name);
+    }
+    // Without a checksum, decompressing checks the gzip CRC-32
+    if (!tile.crc32c || options.gzip_level > 0) {
+      std::vector<char> decoded = gzip_decompress(bytes);
+      if (options.gzip_level > 0) {
+        bytes = gzip_compress(decoded, options.gzip_level);
+      }
+    }
+
+    uint64_t hash = static_cast<uint64_t>(crc) << 32 ^ tile.size;
+    if (options.dedupe && !entry.mask) {
+      auto range = stored.equal_range(hash);
+      auto same = std::find_if(range.first, range.second, [&](const auto &s) {
+        return s.second.size == tile.size &&
+               std::equal(data, data + tile.size, s.second.data);
+      });
+      if (same != range.second) {
+        TileInfo duplicate = same->second.info;
+        duplicate.key = tile.key;
+        duplicates.push_back(duplicate);
+        ++result.deduplicated;
+        continue;
+      }
+    }
+
+    const TileInfo &info = writer.add_compressed(tile.key, bytes, entry.mask);
+    if (options.dedupe && !entry.mask) {
+      stored.emplace(hash, Stored{data, tile.size, info});
+    }
+  }
+  writer.finish();
+
+  TileIndex repacked =
+      writer.index(index.width, index.height, index.tile_size);
+  repacked.tiles.insert(repacked.tiles.end(), duplicates.begin(),
+                        duplicates.end());
+  // The index lists tiles in pyramid order whatever their order on disk
+  for (auto *tiles : {&repacked.tiles, &repacked.masks}) {
+    std::sort(tiles->begin(), tiles->end(),
+              [](const TileInfo &a, const TileInfo &b) {
+                int a_level, a_y, a_x, b_level, b_y, b_x;
+                parse_tile_key(a.key, a_level, a_y, a_x);
+                parse_tile_key(b.key, b_level, b_y, b_x);
+                return std::tie(a_level, a_y, a_x) <
+                       std::tie(b_level, b_y, b_x);
+              });
+  }
+  write_metadata(staging, repacked);
+  if (options.binary_index) {
+    write_binary_index(staging / "metadata.idx", repacked);
+  }
+
+  result.tiles = repacked.tiles.size();
+  for (const auto &entry : fs::directory_iterator(staging)) {
+    if (entry.path().extension() == ".binz") {
+      result.bytes_after += entry.file_size();
+    }
+  }
+  return result;
+}
+
+} // namespace
+
+RepackResult repack_output(const fs::path &folder,
+                           const RepackOptions &options) {
+  if (options.order != "pyramid" && options.order != "zorder") {
+    throw std::runtime_error("Unknown tile order: " + options.order);
+  }
+  if (options.supertile > 0 && (options.order != "pyramid" ||
+                                options.dedupe || options.alignment > 1)) {
+    throw std::runtime_error("Supertiles need pyramid order, without "
+                             "deduplication or alignment");
+  }
+  if (options.alignment == 0) {
+    throw std::runtime_error("Alignment must be at least 1");
+  }
+
+  fs::path absolute = fs::absolute(folder).lexically_normal();
+  if (absolute.filename().empty()) {
+    absolute = absolute.parent_path();
+  }
+  fs::path staging = absolute.parent_path() /
+                     ("." + absolute.filename().string() + ".repack");
+  fs::remove_all(staging);
+  fs::create_directories(staging);
+
+  try {
+    RepackResult result = write_repacked(absolute, staging, options);
+
+    // Refuse to publish anything that would not verify
+    VerifyResult check = verify_output(staging);
+    if (!check.damage.empty()) {
+      throw std::runtime_error("Repacked output failed verification at " +
+                               check.damage.front().key);
+    }
+
+    // Kept tiles, source.blocks and the like carry over unchanged
+    for (const auto &entry : fs::directory_iterator(absolute)) {
+      fs::path target = staging / entry.path().filename();
+      if (entry.is_directory()) {
+        link_tree(entry.path(), target);
+      } else if (entry.is_regular_file() && !is_repacked_file(entry.path())) {
+        link_file(entry.path(), target);
+      }
+    }
+
+    exchange_folders(absolute, staging);
+    fs::remove_all(staging);
+    return result;
+  } catch (...) {
+    std::error_code ec;
+    fs::remove_all(staging, ec);
+    throw;
+  }
+}
+
+} // namespace tiler
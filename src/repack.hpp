@@ -0,0 +1,49 @@
+#pragma once
+
+#include "binz.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Rewriting finished outputs into another layout without tiling them again.
+
+namespace tiler {
+
+struct RepackOptions {
+  // Order of the tiles in the new binaries: "pyramid" (level, row, column)
+  // or "zorder" (level, then the Morton order of row and column, so that
+  // tiles close in both directions are close on disk)
+  std::string order = "pyramid";
+  // gzip level 1-9 to recompress the tiles with; 0 copies the stored bytes
+  int gzip_level = 0;
+  // Start every tile at a multiple of this many bytes
+  size_t alignment = 1;
+  // Binaries and records to write, as TilerOptions::level_files and
+  // TilerOptions::supertile
+  std::string level_files;
+  int supertile = 0;
+  // Store tiles with identical bytes once
+  bool dedupe = false;
+  // Also write the binary index of the output as metadata.idx
+  bool binary_index = false;
+};
+
+struct RepackResult {
+  size_t tiles = 0;
+  size_t deduplicated = 0;
+  uint64_t bytes_before = 0;
+  uint64_t bytes_after = 0;
+};
+
+// Rewrite the output in `folder` with `options`. Only the tiles, masks and
+// supertile records its index lists are carried over, so bytes left dead by
+// --update are dropped. Every tile is checked against its CRC-32C, or
+// without one against its gzip trailer, before it is copied. The new output
+// is built and verified next to the folder, then swapped in, atomically on
+// Linux; on failure the folder is left as it was. Other files and folders
+// in it are carried over as hard links.
+RepackResult repack_output(const fs::path &folder,
+                           const RepackOptions &options);
+
+} // namespace tiler
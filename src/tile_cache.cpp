@@ -0,0 +1,292 @@
+#include "tile_cache.hpp"
+#include "checksum.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace tiler {
+
+namespace {
+
+// Rough bookkeeping cost of one entry besides its key and tile bytes
+constexpr size_t kEntryOverhead = 96;
+
+// Typical size of a tile, for sizing the frequency sketch
+constexpr size_t kTypicalTileBytes = 16 * 1024;
+
+uint64_t mix(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 33);
+}
+
+// Count-min sketch of 4-bit counters, four rows packed into one table. Once
+// it has counted ten times as many accesses as it has counters, all
+// counters are halved, so popularity fades unless it is renewed.
+class FrequencySketch {
+public:
+  explicit FrequencySketch(size_t counters) {
+    size_t words = 1;
+    while (words * 16 < counters) {
+      words *= 2;
+    }
+    table_.assign(words, 0);
+    sample_size_ = 10 * words * 16;
+  }
+
+  int frequency(uint64_t hash) const {
+    int frequency = 15;
+    for (int row = 0; row < 4; ++row) {
+      size_t counter = index(hash, row);
+      frequency = std::min(frequency, get(counter));
+    }
+    return frequency;
+  }
+
+  void increment(uint64_t hash) {
+    bool added = false;
+    for (int row = 0; row < 4; ++row) {
+      size_t counter = index(hash, row);
+      if (get(counter) < 15) {
+        table_[counter / 16] += uint64_t(1) << (counter % 16 * 4);
+        added = true;
+      }
+    }
+    if (added && ++additions_ >= sample_size_) {
+      for (auto &word : table_) {
+        word = (word >> 1) & 0x7777777777777777ULL;
+      }
+      additions_ /= 2;
+    }
+  }
+
+private:
+  size_t index(uint64_t hash, int row) const {
+    static const uint64_t seeds[] = {0x97cb3127e5a0d4bfULL,
+                                     0x8c2f1d5b9e6a7301ULL,
+                                     0xd6e8feb86659fd93ULL,
+                                     0x3c6ef372fe94f82bULL};
+    uint64_t h = mix(hash + seeds[row]);
+    return h & (table_.size() * 16 - 1);
+  }
+
+  int get(size_t counter) const {
+    return (table_[counter / 16] >> (counter % 16 * 4)) & 0xf;
+  }
+
+  std::vector<uint64_t> table_;
+  size_t sample_size_;
+  size_t additions_ = 0;
+};
+
+} // namespace
+
+// One shard: window LRU, then the main segment split into probation and
+// protected LRUs. Tiles hit while on probation are promoted to protected;
+// protected overflow is demoted back to probation.
+struct TileCache::Shard {
+  enum Segment { kWindow, kProbation, kProtected };
+
+  struct Entry {
+    std::string key;
+    Tile tile;
+    size_t cost;
+    uint64_t hash;
+    Segment segment;
+  };
+  using List = std::list<Entry>;
+
+  explicit Shard(size_t capacity)
+      : capacity(capacity),
+        window_capacity(
+            std::min(std::max<size_t>(capacity / 100, 1), capacity)),
+        protected_capacity((capacity - window_capacity) * 8 / 10),
+        sketch(std::max<size_t>(capacity / kTypicalTileBytes, 1024)) {}
+
+  List &list(Segment segment) {
+    return segment == kWindow      ? window
+           : segment == kProbation ? probation
+                                   : protected_;
+  }
+
+  // Move an entry to the front of `segment`
+  void move(List::iterator entry, Segment segment) {
+    bytes[entry->segment] -= entry->cost;
+    bytes[segment] += entry->cost;
+    List &from = list(entry->segment);
+    entry->segment = segment;
+    list(segment).splice(list(segment).begin(), from, entry);
+  }
+
+  void erase(List::iterator entry) {
+    bytes[entry->segment] -= entry->cost;
+    index.erase(entry->key);
+    list(entry->segment).erase(entry);
+  }
+
+  size_t main_bytes() const { return bytes[kProbation] + bytes[kProtected]; }
+
+  void balance_protected() {
+    while (bytes[kProtected] > protected_capacity) {
+      move(std::prev(protected_.end()), kProbation);
+    }
+  }
+
+  // Move tiles that no longer fit the window into the main segment, each
+  // only if it is more popular than the tiles it would displace
+  void drain_window() {
+    while (bytes[kWindow] > window_capacity) {
+      auto candidate = std::prev(window.end());
+      size_t main_capacity = capacity - window_capacity;
+      bool admitted = true;
+      while (main_bytes() + candidate->cost > main_capacity) {
+        List &victims = probation.empty() ? protected_ : probation;
+        auto victim = std::prev(victims.end());
+        if (sketch.frequency(candidate->hash) <=
+            sketch.frequency(victim->hash)) {
+          admitted = false;
+          break;
+        }
+        erase(victim);
+        ++stats.evictions;
+      }
+      if (admitted) {
+        move(candidate, kProbation);
+      } else {
+        erase(candidate);
+        ++stats.rejections;
+      }
+    }
+  }
+
+  std::mutex mutex;
+  size_t capacity;
+  size_t window_capacity;
+  size_t protected_capacity;
+  List window;
+  List probation;
+  List protected_;
+  size_t bytes[3] = {0, 0, 0};
+  std::unordered_map<std::string, List::iterator> index;
+  FrequencySketch sketch;
+  Stats stats;
+};
+
+TileCache::TileCache(size_t capacity_bytes, size_t shards)
+    : capacity_(capacity_bytes) {
+  shards = std::max<size_t>(shards, 1);
+  for (size_t i = 0; i < shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>(capacity_bytes / shards));
+  }
+}
+
+TileCache::~TileCache() = default;
+
+TileCache::Shard &TileCache::shard(uint64_t hash) {
+  return *shards_[(hash >> 32) % shards_.size()];
+}
+
+TileCache::Tile TileCache::get(const std::string &key) {
+  uint64_t hash = mix(std::hash<std::string>()(key));
+  Shard &shard = this->shard(hash);
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.sketch.increment(hash);
+  auto found = shard.index.find(key);
+  if (found == shard.index.end()) {
+    ++shard.stats.misses;
+    return nullptr;
+  }
+  ++shard.stats.hits;
+
+  auto entry = found->second;
+  if (entry->segment == Shard::kWindow) {
+    shard.move(entry, Shard::kWindow);
+  } else {
+    shard.move(entry, Shard::kProtected);
+    shard.balance_protected();
+  }
+  return entry->tile;
+}
+
+void TileCache::put(const std::string &key, Tile tile) {
+  if (capacity_ == 0) {
+    return;
+  }
+  uint64_t hash = mix(std::hash<std::string>()(key));
+  Shard &shard = this->shard(hash);
+  size_t cost = key.size() + tile->size() + kEntryOverhead;
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto found = shard.index.find(key);
+  if (found != shard.index.end()) {
+    shard.erase(found->second);
+  }
+  if (cost > shard.capacity - shard.window_capacity) {
+    return;
+  }
+
+  shard.window.push_front({key, std::move(tile), cost, hash, Shard::kWindow});
+  shard.index[key] = shard.window.begin();
+  shard.bytes[Shard::kWindow] += cost;
+  ++shard.stats.insertions;
+  shard.drain_window();
+}
+
+TileCache::Stats TileCache::stats() const {
+  Stats total;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    total.hits += shard->stats.hits;
+    total.misses += shard->stats.misses;
+    total.insertions += shard->stats.insertions;
+    total.evictions += shard->stats.evictions;
+    total.rejections += shard->stats.rejections;
+    total.entries += shard->index.size();
+    total.bytes += shard->bytes[Shard::kWindow] + shard->main_bytes();
+  }
+  return total;
+}
+
+TileCache::Tile CachedTileReader::raw(const fs::path &folder,
+                                      const TileInfo &tile) {
+  std::string key = (folder / tile.binary_name).string() + "@" +
+                    std::to_string(tile.start_offset);
+  TileCache::Tile data = raw_ ? raw_->get(key) : nullptr;
+  if (!data) {
+    data = std::make_shared<const std::vector<char>>(read_file_range(
+        folder / tile.binary_name, tile.start_offset, tile.size));
+    if (tile.crc32c && crc32c(data->data(), data->size()) != *tile.crc32c) {
+      throw std::runtime_error("Checksum mismatch for tile " + tile.key +
+                               " in " + (folder / tile.binary_name).string());
+    }
+    if (raw_) {
+      raw_->put(key, data);
+    }
+  }
+  return data;
+}
+
+TileCache::Tile CachedTileReader::decoded(const fs::path &folder,
+                                          const TileInfo &tile) {
+  std::string key = (folder / tile.binary_name).string() + "@" +
+                    std::to_string(tile.start_offset);
+  TileCache::Tile data = decoded_ ? decoded_->get(key) : nullptr;
+  if (!data) {
+    data = std::make_shared<const std::vector<char>>(
+        gzip_decompress(*raw(folder, tile)));
+    if (decoded_) {
+      decoded_->put(key, data);
+    }
+  }
+  return data;
+}
+
+} // namespace tiler
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "binz.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// In-memory cache of tiles for readers of .binz outputs and for serving,
+// bounded by the bytes it holds.
+
+namespace tiler {
+
+// Sharded W-TinyLFU cache. New tiles enter a small LRU window; a tile
+// leaving the window only displaces a tile of the main segment if it has
+// been asked for more often, as counted by a frequency sketch with periodic
+// aging. A sweep through many tiles that are each read once, such as a
+// crawler walking the deep levels, therefore cannot flush the tiles in
+// steady demand. Keys are spread over shards with a lock each, and every
+// shard holds an equal part of the memory budget. Safe to use from several
+// threads.
+class TileCache {
+public:
+  using Tile = std::shared_ptr<const std::vector<char>>;
+
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    // Tiles that left the cache to make room
+    uint64_t evictions = 0;
+    // Tiles the admission policy turned away on leaving the window
+    uint64_t rejections = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  explicit TileCache(size_t capacity_bytes, size_t shards = 16);
+  ~TileCache();
+
+  // The tile cached under `key`, or null
+  Tile get(const std::string &key);
+
+  // Cache `tile` under `key`, replacing any tile cached there. Tiles larger
+  // than a shard are not kept, and a cache of capacity 0 keeps nothing.
+  void put(const std::string &key, Tile tile);
+
+  size_t capacity_bytes() const { return capacity_; }
+  Stats stats() const;
+
+private:
+  struct Shard;
+
+  Shard &shard(uint64_t hash);
+
+  size_t capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// Reads tiles out of .binz files through a cache of their stored gzip bytes
+// and a separate cache of the decompressed tiles. Either cache may be null
+// to read around it. Entries are keyed by binary and offset, so tiles
+// appended to a binary never collide with older ones.
+class CachedTileReader {
+public:
+  CachedTileReader(TileCache *raw, TileCache *decoded)
+      : raw_(raw), decoded_(decoded) {}
+
+  // Stored gzip bytes of `tile`, whose binary lies in `folder`. Bytes read
+  // from disk are checked against the tile's CRC-32C when it has one, and
+  // a mismatch throws instead of being cached.
+  TileCache::Tile raw(const fs::path &folder, const TileInfo &tile);
+
+  // Decompressed bytes of `tile`
+  TileCache::Tile decoded(const fs::path &folder, const TileInfo &tile);
+
+private:
+  TileCache *raw_;
+  TileCache *decoded_;
+};
+
+} // namespace tiler
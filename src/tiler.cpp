@@ -0,0 +1,1706 @@
+#include "tiler.hpp"
+#include "archive.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+#include <zlib.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+using namespace vips;
+
+namespace tiler {
+
+namespace {
+
+void log_progress(const ProgressFn &progress, const std::string &line,
+                  bool error = false) {
+  if (progress) {
+    progress(line, error);
+  }
+}
+
+// "[current/total] " or "[current] " when the total is open-ended
+std::string progress_prefix(size_t current, size_t total) {
+  return "[" + std::to_string(current) +
+         (total > 0 ? "/" + std::to_string(total) : "") + "] ";
+}
+
+// Tile files written by dzsave in Google layout (<level>/<y>/<x>.<ext>),
+// sorted for consistent ordering
+std::vector<fs::path> collect_tile_files(const fs::path &tile_folder) {
+  std::vector<fs::path> tile_files;
+  for (const auto &level_entry : fs::directory_iterator(tile_folder)) {
+    if (!level_entry.is_directory())
+      continue;
+    std::string level_name = level_entry.path().filename().string();
+    if (!std::all_of(level_name.begin(), level_name.end(), ::isdigit))
+      continue;
+
+    for (const auto &y_entry : fs::directory_iterator(level_entry)) {
+      if (!y_entry.is_directory())
+        continue;
+
+      for (const auto &tile_entry : fs::directory_iterator(y_entry)) {
+        if (!tile_entry.is_regular_file())
+          continue;
+        std::string ext = tile_entry.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext == ".png" || ext == ".jpg" || ext == ".jpeg" ||
+            ext == ".webp") {
+          tile_files.push_back(tile_entry.path());
+        }
+      }
+    }
+  }
+
+  std::sort(tile_files.begin(), tile_files.end());
+  return tile_files;
+}
+
+// Level, y and x of a tile file from its <level>/<y>/<x>.<ext> path
+void parse_tile_path(const fs::path &tile_path, int &level, int &y, int &x) {
+  fs::path parent = tile_path.parent_path();
+  x = std::stoi(tile_path.stem().string());
+  y = std::stoi(parent.filename().string());
+  level = std::stoi(parent.parent_path().filename().string());
+}
+
+// Delete the level directories and blank.png that dzsave wrote
+void remove_tile_folders(const fs::path &tile_folder) {
+  for (const auto &entry : fs::directory_iterator(tile_folder)) {
+    if (!entry.is_directory())
+      continue;
+    std::string name = entry.path().filename().string();
+    if (std::all_of(name.begin(), name.end(), ::isdigit)) {
+      fs::remove_all(entry.path());
+    }
+  }
+
+  // Remove blank.png if exists
+  fs::path blank_png = tile_folder / "blank.png";
+  if (fs::exists(blank_png)) {
+    fs::remove(blank_png);
+  }
+}
+
+// Merge the tiles dzsave wrote into `writer` and return their index, with
+// the image geometry left for the caller to fill in
+TileIndex merge_tiles_to_binary(const fs::path &tile_folder,
+                                TileSink &writer, bool keep_tiles,
+                                int supertile = 0) {
+  // Supertiles need the tiles of a level in numeric row order
+  auto tile_files = collect_tile_files(tile_folder);
+  if (supertile > 0) {
+    std::sort(tile_files.begin(), tile_files.end(),
+              [](const fs::path &a, const fs::path &b) {
+                int a_level, a_y, a_x, b_level, b_y, b_x;
+                parse_tile_path(a, a_level, a_y, a_x);
+                parse_tile_path(b, b_level, b_y, b_x);
+                return std::tie(a_level, a_y, a_x) <
+                       std::tie(b_level, b_y, b_x);
+              });
+  }
+
+  // Process each tile
+  for (const auto &tile_path : tile_files) {
+    int level, y, x;
+    parse_tile_path(tile_path, level, y, x);
+    writer.add(make_tile_key(level, y, x), read_file(tile_path));
+  }
+  writer.finish();
+
+  TileIndex index = writer.index(0, 0, 0);
+
+  // Delete tile directories if not keeping
+  if (!keep_tiles) {
+    remove_tile_folders(tile_folder);
+  }
+
+  return index;
+}
+
+// Place one file of a finished output at a duplicate destination
+void replicate_file(const fs::path &source, const fs::path &target,
+                    const std::string &link_mode) {
+  std::error_code ec;
+  fs::remove(target, ec);
+
+  if (link_mode == "hardlink") {
+    fs::create_hard_link(source, target, ec);
+    if (!ec) {
+      return;
+    }
+  }
+#ifdef __linux__
+  if (link_mode == "reflink") {
+    int in = ::open(source.c_str(), O_RDONLY);
+    int out = in < 0 ? -1 : ::open(target.c_str(), O_WRONLY | O_CREAT, 0644);
+    bool cloned = out >= 0 && ::ioctl(out, FICLONE, in) == 0;
+    if (in >= 0)
+      ::close(in);
+    if (out >= 0)
+      ::close(out);
+    if (cloned) {
+      return;
+    }
+    fs::remove(target, ec);
+  }
+#endif
+  // Hardlinks across devices and reflinks on filesystems without support
+  // fall back to a plain copy
+  fs::copy_file(source, target, fs::copy_options::overwrite_existing);
+}
+
+// Copy the artifacts of every variant (binaries or archive, metadata and
+// kept tiles) and the block hashes of --update from a finished output
+// folder to a duplicate destination.
+// Throws if a variant of the destination ends up without an index.
+void replicate_output(const fs::path &source, const fs::path &target,
+                      const TilerOptions &config) {
+  std::string archive =
+      config.archive.empty() ? "" : archive_file_name(config.archive);
+  for (const auto &variant : config.variants) {
+    fs::path from = source / variant.subfolder;
+    fs::path to = target / variant.subfolder;
+    fs::create_directories(to);
+
+    for (const auto &entry : fs::directory_iterator(from)) {
+      std::string name = entry.path().filename().string();
+      bool is_level =
+          entry.is_directory() &&
+          std::all_of(name.begin(), name.end(), ::isdigit);
+
+      // Level binaries (tiles_l<level>.binz) come with their own index
+      bool is_level_file = name.rfind("tiles_l", 0) == 0;
+
+      if (entry.is_regular_file() &&
+          (name == "tiles_000.binz" || name == "metadata.json" ||
+           is_level_file || (!archive.empty() && name == archive))) {
+        replicate_file(entry.path(), to / name, config.dedupe_link);
+      } else if (is_level && config.keep_tiles) {
+        for (const auto &tile : fs::recursive_directory_iterator(entry)) {
+          fs::path relative = fs::relative(tile.path(), from);
+          if (tile.is_directory()) {
+            fs::create_directories(to / relative);
+          } else if (tile.is_regular_file()) {
+            replicate_file(tile.path(), to / relative, config.dedupe_link);
+          }
+        }
+      }
+    }
+
+    fs::path index = to / (archive.empty() ? "metadata.json" : archive);
+    if (!fs::is_regular_file(index)) {
+      throw std::runtime_error("Replica " + to.string() + " has no " +
+                               index.filename().string());
+    }
+  }
+
+  // The block hashes of --update, so the replica can be updated in place.
+  // They are rewritten in place, so a replica gets a copy, never a link.
+  if (fs::is_regular_file(source / "source.blocks")) {
+    fs::copy_file(source / "source.blocks", target / "source.blocks",
+                  fs::copy_options::overwrite_existing);
+  }
+}
+
+// One entry of a zip archive held in memory
+struct ZipEntry {
+  std::string name;
+  uint16_t method;
+  uint64_t compressed_size;
+  uint64_t size;
+  uint64_t local_offset;
+};
+
+uint64_t load_le(const unsigned char *data, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    value |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+// Read the central directory of a zip archive, including zip64 archives,
+// which dzsave writes once a pyramid has more than 65535 tiles
+std::vector<ZipEntry> read_zip_directory(const unsigned char *data,
+                                         size_t size) {
+  // The end of central directory record sits in the last 64 KiB + 22 bytes
+  size_t eocd = std::string::npos;
+  size_t lowest = size > 65557 ? size - 65557 : 0;
+  for (size_t pos = size >= 22 ? size - 22 : 0; pos + 22 <= size; --pos) {
+    if (load_le(data + pos, 4) == 0x06054b50) {
+      eocd = pos;
+      break;
+    }
+    if (pos == lowest)
+      break;
+  }
+  if (eocd == std::string::npos) {
+    throw std::runtime_error("Malformed zip: no end of central directory");
+  }
+
+  uint64_t count = load_le(data + eocd + 10, 2);
+  uint64_t directory = load_le(data + eocd + 16, 4);
+  if (eocd >= 20 && load_le(data + eocd - 20, 4) == 0x07064b50) {
+    uint64_t record = load_le(data + eocd - 20 + 8, 8);
+    if (record + 56 > size || load_le(data + record, 4) != 0x06064b50) {
+      throw std::runtime_error("Malformed zip64 end of central directory");
+    }
+    count = load_le(data + record + 32, 8);
+    directory = load_le(data + record + 48, 8);
+  }
+
+  std::vector<ZipEntry> entries;
+  size_t pos = directory;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (pos + 46 > size || load_le(data + pos, 4) != 0x02014b50) {
+      throw std::runtime_error("Malformed zip central directory");
+    }
+    ZipEntry entry;
+    entry.method = load_le(data + pos + 10, 2);
+    entry.compressed_size = load_le(data + pos + 20, 4);
+    entry.size = load_le(data + pos + 24, 4);
+    size_t name_length = load_le(data + pos + 28, 2);
+    size_t extra_length = load_le(data + pos + 30, 2);
+    size_t comment_length = load_le(data + pos + 32, 2);
+    entry.local_offset = load_le(data + pos + 42, 4);
+    entry.name.assign(reinterpret_cast<const char *>(data + pos + 46),
+                      name_length);
+
+    // Zip64 extended information replaces the fields that overflowed
+    const unsigned char *extra = data + pos + 46 + name_length;
+    for (size_t e = 0; e + 4 <= extra_length;) {
+      size_t id = load_le(extra + e, 2);
+      size_t length = load_le(extra + e + 2, 2);
+      if (id == 0x0001) {
+        const unsigned char *field = extra + e + 4;
+        if (entry.size == 0xffffffff) {
+          entry.size = load_le(field, 8);
+          field += 8;
+        }
+        if (entry.compressed_size == 0xffffffff) {
+          entry.compressed_size = load_le(field, 8);
+          field += 8;
+        }
+        if (entry.local_offset == 0xffffffff) {
+          entry.local_offset = load_le(field, 8);
+        }
+      }
+      e += 4 + length;
+    }
+
+    entries.push_back(entry);
+    pos += 46 + name_length + extra_length + comment_length;
+  }
+  return entries;
+}
+
+std::vector<char> read_zip_entry(const unsigned char *data, size_t size,
+                                 const ZipEntry &entry) {
+  size_t local = entry.local_offset;
+  if (local + 30 > size || load_le(data + local, 4) != 0x04034b50) {
+    throw std::runtime_error("Malformed zip entry: " + entry.name);
+  }
+  size_t start = local + 30 + load_le(data + local + 26, 2) +
+                 load_le(data + local + 28, 2);
+  if (start + entry.compressed_size > size) {
+    throw std::runtime_error("Truncated zip entry: " + entry.name);
+  }
+
+  const char *bytes = reinterpret_cast<const char *>(data + start);
+  if (entry.method == 0) {
+    return std::vector<char>(bytes, bytes + entry.compressed_size);
+  }
+  if (entry.method != 8) {
+    throw std::runtime_error("Unsupported zip compression in " + entry.name);
+  }
+
+  // Raw deflate
+  std::vector<char> inflated(entry.size);
+  z_stream stream{};
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(bytes));
+  stream.avail_in = entry.compressed_size;
+  stream.next_out = reinterpret_cast<Bytef *>(inflated.data());
+  stream.avail_out = inflated.size();
+  if (inflateInit2(&stream, -15) != Z_OK) {
+    throw std::runtime_error("Failed to initialize zip decompression");
+  }
+  int status = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+    throw std::runtime_error("Failed to decompress zip entry: " + entry.name);
+  }
+  return inflated;
+}
+
+// Resampling kernel by name, as accepted by --kernel
+VipsKernel resample_kernel(const std::string &name) {
+  static const std::map<std::string, VipsKernel> kernels = {
+      {"nearest", VIPS_KERNEL_NEAREST},   {"linear", VIPS_KERNEL_LINEAR},
+      {"cubic", VIPS_KERNEL_CUBIC},       {"mitchell", VIPS_KERNEL_MITCHELL},
+      {"lanczos2", VIPS_KERNEL_LANCZOS2}, {"lanczos3", VIPS_KERNEL_LANCZOS3}};
+  auto it = kernels.find(name);
+  if (it == kernels.end()) {
+    throw std::runtime_error("Unknown resampling kernel: " + name);
+  }
+  return it->second;
+}
+
+// dzsave level shrink by name, as accepted by --level-shrink
+VipsRegionShrink level_shrink(const std::string &name) {
+  static const std::map<std::string, VipsRegionShrink> shrinks = {
+      {"mean", VIPS_REGION_SHRINK_MEAN},
+      {"median", VIPS_REGION_SHRINK_MEDIAN},
+      {"mode", VIPS_REGION_SHRINK_MODE},
+      {"max", VIPS_REGION_SHRINK_MAX},
+      {"min", VIPS_REGION_SHRINK_MIN},
+      {"nearest", VIPS_REGION_SHRINK_NEAREST}};
+  auto it = shrinks.find(name);
+  if (it == shrinks.end()) {
+    throw std::runtime_error("Unknown level shrink: " + name);
+  }
+  return it->second;
+}
+
+// Narrow an image to 8-bit sRGB (or 8-bit greyscale) right after decode, so
+// resize and dzsave move a half or a quarter of the bytes of 16-bit or float
+// pixels. "icc" converts through the embedded profile when there is one,
+// "srgb" through the image's interpretation only, "off" keeps the native
+// format until the tiles are encoded.
+VImage normalize_colour(VImage image, const std::string &mode) {
+  if (mode == "off") {
+    return image;
+  }
+
+  VipsInterpretation interpretation = image.interpretation();
+  bool grey = interpretation == VIPS_INTERPRETATION_B_W ||
+              interpretation == VIPS_INTERPRETATION_GREY16;
+  if (mode == "icc" && image.get_typeof("icc-profile-data")) {
+    image = image.icc_transform(
+        "srgb", VImage::option()->set("embedded", true)->set("depth", 8));
+  } else if (grey && (interpretation != VIPS_INTERPRETATION_B_W ||
+                      image.format() != VIPS_FORMAT_UCHAR)) {
+    image = image.colourspace(VIPS_INTERPRETATION_B_W);
+  } else if (!grey && (interpretation != VIPS_INTERPRETATION_sRGB ||
+                       image.format() != VIPS_FORMAT_UCHAR)) {
+    image = image.colourspace(VIPS_INTERPRETATION_sRGB);
+  }
+
+  // Whatever is left (e.g. multiband data) is clipped to 8 bits
+  if (image.format() != VIPS_FORMAT_UCHAR) {
+    image = image.cast(VIPS_FORMAT_UCHAR);
+  }
+  return image;
+}
+
+// Resize to a width x height square with the configured kernel
+VImage resize_to(const VImage &image, double width, double height,
+                 const std::string &kernel) {
+  return image.resize(width / image.width(),
+                      VImage::option()
+                          ->set("vscale", height / image.height())
+                          ->set("kernel", resample_kernel(kernel)));
+}
+
+VOption *dzsave_options(const OutputVariant &variant,
+                        const std::string &shrink) {
+  auto options = VImage::option()
+                     ->set("layout", VIPS_FOREIGN_DZ_LAYOUT_GOOGLE)
+                     ->set("depth", VIPS_FOREIGN_DZ_DEPTH_ONETILE)
+                     ->set("tile_size", variant.tile_size)
+                     ->set("skip_blanks", -1)
+                     ->set("region_shrink", level_shrink(shrink))
+                     ->set("suffix", variant.suffix.c_str());
+
+  // Set quality if using a lossy format
+  if (variant.suffix != ".png") {
+    options->set("Q", variant.quality);
+  }
+  return options;
+}
+
+// Tile one variant of an already resized image into its output folder and
+// return the number of tiles written
+size_t tile_variant(const VImage &image, const fs::path &output_folder,
+                    const OutputVariant &variant, int target_size,
+                    const std::string &shrink, bool keep_tiles, int supertile,
+                    const LevelFiles &level_files,
+                    const ProgressFn &progress) {
+  fs::create_directories(output_folder);
+  image.dzsave(output_folder.string().c_str(),
+               dzsave_options(variant, shrink));
+
+  // Merge tiles to binary
+  log_progress(progress, "  Merging tiles to binary...");
+
+  LevelTileWriter writer(output_folder, level_files, supertile);
+  TileIndex index =
+      merge_tiles_to_binary(output_folder, writer, keep_tiles, supertile);
+  index.width = target_size;
+  index.height = target_size;
+  index.tile_size = variant.tile_size;
+
+  // Write metadata
+  write_metadata(output_folder, index);
+
+  return index.tiles.size();
+}
+
+int log2_exact(int n) {
+  int log = 0;
+  while ((1 << log) < n) {
+    ++log;
+  }
+  return log;
+}
+
+fs::path region_folder(const fs::path &output_folder, int region) {
+  return output_folder / "regions" / ("r" + std::to_string(region));
+}
+
+// Tile one region of a split image. With the image split into split x split
+// square regions of a power-of-two size, the Google pyramid of a region is
+// the global pyramid from level log2(split) down, restricted to that region.
+// Its tiles are merged into regions/r<k>/tiles_000.binz and listed under
+// their global keys in regions/r<k>/region.idx.
+size_t tile_region_variant(const VImage &image, const fs::path &output_folder,
+                           const OutputVariant &variant, int target_size,
+                           const std::string &shrink, unsigned int split,
+                           int region, bool keep_tiles) {
+  int region_size = target_size / static_cast<int>(split);
+  if (region_size < variant.tile_size || region_size % variant.tile_size) {
+    throw std::runtime_error(
+        "split " + std::to_string(split) + " leaves regions of " +
+        std::to_string(region_size) + " pixels, which is not a multiple of " +
+        "tile size " + std::to_string(variant.tile_size));
+  }
+
+  int depth = log2_exact(split);
+  int region_y = region / split;
+  int region_x = region % split;
+  VImage part = image.crop(region_x * region_size, region_y * region_size,
+                           region_size, region_size);
+
+  fs::path folder = region_folder(output_folder, region);
+  fs::create_directories(folder);
+  part.dzsave(folder.string().c_str(), dzsave_options(variant, shrink));
+
+  LevelTileWriter writer(folder, LevelFiles());
+  auto tiles_map = merge_tiles_to_binary(folder, writer, keep_tiles).tiles;
+  for (auto &tile : tiles_map) {
+    int level, y, x;
+    parse_tile_key(tile.key, level, y, x);
+    tile.key = make_tile_key(level + depth, (region_y << level) + y,
+                             (region_x << level) + x);
+  }
+  write_binary_index(folder / "region.idx",
+                     {target_size, target_size, variant.tile_size, tiles_map,
+                      {}, 0, {}});
+
+  return tiles_map.size();
+}
+
+// Join the regions of a split image into the usual tiles_000.binz and
+// metadata.json. Region binaries are concatenated as they are. The levels
+// above the regions are built from a mosaic of the region top tiles, which
+// are exactly the tiles of level log2(split). With a lossy format they are
+// decoded and encoded again, so those levels lose a little more detail than
+// in an unsplit run.
+size_t stitch_variant(const fs::path &output_folder,
+                      const OutputVariant &variant, const std::string &shrink,
+                      unsigned int split, bool keep_tiles, int &target_size) {
+  int depth = log2_exact(split);
+  int regions = split * split;
+  fs::path binary_path = output_folder / "tiles_000.binz";
+  std::ofstream binary_file(binary_path, std::ios::binary);
+
+  if (!binary_file) {
+    throw std::runtime_error("Cannot create binary file: " +
+                             binary_path.string());
+  }
+
+  std::vector<TileInfo> tiles_map;
+  std::vector<VImage> top_tiles;
+  size_t current_offset = 0;
+
+  for (int region = 0; region < regions; ++region) {
+    fs::path folder = region_folder(output_folder, region);
+    TileIndex index = read_binary_index(folder / "region.idx");
+    target_size = index.width;
+
+    fs::path region_binary = folder / "tiles_000.binz";
+    size_t region_bytes = fs::file_size(region_binary);
+    if (region_bytes > 0) {
+      std::ifstream in(region_binary, std::ios::binary);
+      binary_file << in.rdbuf();
+    }
+
+    std::string top_key = make_tile_key(depth, region / split, region % split);
+    for (auto tile : index.tiles) {
+      if (tile.key == top_key) {
+        auto data = gzip_decompress(
+            read_file_range(region_binary, tile.start_offset, tile.size));
+        top_tiles.push_back(
+            VImage::new_from_buffer(data.data(), data.size(), "")
+                .copy_memory());
+      }
+      tile.binary_name = "tiles_000.binz";
+      tile.start_offset += current_offset;
+      tiles_map.push_back(tile);
+    }
+    current_offset += region_bytes;
+  }
+
+  if (top_tiles.size() != static_cast<size_t>(regions)) {
+    throw std::runtime_error("Region top tiles missing in " +
+                             output_folder.string());
+  }
+
+  // Coarse levels
+  fs::path coarse = output_folder / "regions" / "coarse";
+  fs::create_directories(coarse);
+  VImage mosaic = VImage::arrayjoin(
+      top_tiles, VImage::option()->set("across", static_cast<int>(split)));
+  mosaic.dzsave(coarse.string().c_str(), dzsave_options(variant, shrink));
+
+  StreamSink sink(binary_file);
+  TileWriter writer(sink, "tiles_000.binz", current_offset);
+  for (const auto &tile_path : collect_tile_files(coarse)) {
+    int level, y, x;
+    parse_tile_path(tile_path, level, y, x);
+    if (level < depth) {
+      tiles_map.push_back(
+          writer.add(make_tile_key(level, y, x), read_file(tile_path)));
+    }
+  }
+
+  binary_file.close();
+
+  write_metadata(output_folder, target_size, target_size, variant.tile_size,
+                 tiles_map);
+
+  if (!keep_tiles) {
+    fs::remove_all(output_folder / "regions");
+  }
+
+  return tiles_map.size();
+}
+
+// Hold the resized image so several variants can be tiled from one decode
+// and resample. Small images stay in memory, large ones go to a temp file
+// that libvips deletes once the last reference is dropped.
+VImage cache_resized(const VImage &image, size_t cache_limit_mb) {
+  size_t bytes = static_cast<size_t>(image.width()) * image.height() *
+                 image.bands() * vips_format_sizeof(image.format());
+  if (bytes <= cache_limit_mb * 1024 * 1024) {
+    return image.copy_memory();
+  }
+  return image.write(VImage::new_temp_file("%s.v"));
+}
+
+// Pyramids up to this many bytes of decoded pixels are built in memory by
+// for_each_dzsave_tile, larger ones in a temporary folder
+constexpr size_t kMemoryPyramidBytes = size_t(256) << 20;
+
+// Empty folder of its own in the system temp folder, removed again with
+// everything in it when the object goes away
+class TempFolder {
+public:
+  TempFolder() {
+    static std::atomic<unsigned int> counter{0};
+    std::random_device random;
+    do {
+      path_ = fs::temp_directory_path() /
+              ("tiler-" + std::to_string(random()) + "-" +
+               std::to_string(counter++));
+    } while (!fs::create_directory(path_));
+  }
+  ~TempFolder() {
+    std::error_code ec;
+    fs::remove_all(path_, ec);
+  }
+  TempFolder(const TempFolder &) = delete;
+  TempFolder &operator=(const TempFolder &) = delete;
+
+  const fs::path &path() const { return path_; }
+
+private:
+  fs::path path_;
+};
+
+// Run dzsave and hand its tiles to `fn` in the order merge_tiles_to_binary
+// uses for a tile folder. Small pyramids are written as an uncompressed zip
+// in memory. Larger ones go to a temporary folder and are read back one
+// tile at a time, so memory stays bounded whatever the size of the output.
+void for_each_dzsave_tile(
+    const VImage &image, VOption *options,
+    const std::function<void(int level, int y, int x,
+                             const std::vector<char> &data)> &fn) {
+  double pixel_bytes = double(image.width()) * image.height() *
+                       image.bands() * vips_format_sizeof(image.format());
+  if (pixel_bytes * 4 / 3 > kMemoryPyramidBytes) {
+    TempFolder temp;
+    fs::path pyramid = temp.path() / "pyramid";
+    image.dzsave(pyramid.string().c_str(), options);
+    auto tile_files = collect_tile_files(pyramid);
+    std::vector<std::tuple<int, int, int, size_t>> order;
+    for (size_t i = 0; i < tile_files.size(); ++i) {
+      int level, y, x;
+      parse_tile_path(tile_files[i], level, y, x);
+      order.emplace_back(level, y, x, i);
+    }
+    std::sort(order.begin(), order.end());
+    for (const auto &[level, y, x, i] : order) {
+      fn(level, y, x, read_file(tile_files[i]));
+    }
+    return;
+  }
+
+  std::unique_ptr<VipsBlob, void (*)(VipsBlob *)> zip(
+      image.dzsave_buffer(
+          options->set("container", VIPS_FOREIGN_DZ_CONTAINER_ZIP)
+              ->set("compression", 0)),
+      [](VipsBlob *blob) { vips_area_unref(VIPS_AREA(blob)); });
+  size_t zip_size;
+  auto *zip_data = static_cast<const unsigned char *>(
+      vips_blob_get(zip.get(), &zip_size));
+
+  // Entries are <name>/<level>/<y>/<x>.<ext>; anything else (blank.png,
+  // properties) is skipped
+  struct ZipTile {
+    int level, y, x;
+    ZipEntry entry;
+  };
+  std::vector<ZipTile> zip_tiles;
+  for (const auto &entry : read_zip_directory(zip_data, zip_size)) {
+    fs::path path(entry.name);
+    std::string x = path.stem().string();
+    std::string y = path.parent_path().filename().string();
+    std::string level = path.parent_path().parent_path().filename().string();
+    auto numeric = [](const std::string &part) {
+      return !part.empty() && std::all_of(part.begin(), part.end(), ::isdigit);
+    };
+    if (numeric(x) && numeric(y) && numeric(level)) {
+      ZipTile tile;
+      tile.level = std::stoi(level);
+      tile.y = std::stoi(y);
+      tile.x = std::stoi(x);
+      tile.entry = entry;
+      zip_tiles.push_back(tile);
+    }
+  }
+  std::sort(zip_tiles.begin(), zip_tiles.end(),
+            [](const ZipTile &a, const ZipTile &b) {
+              return std::tie(a.level, a.y, a.x) < std::tie(b.level, b.y, b.x);
+            });
+
+  for (const auto &tile : zip_tiles) {
+    fn(tile.level, tile.y, tile.x,
+       read_zip_entry(zip_data, zip_size, tile.entry));
+  }
+}
+
+// Copy the bytes of an encoded image out of its blob
+std::vector<char> take_blob(VipsBlob *blob) {
+  std::unique_ptr<VipsBlob, void (*)(VipsBlob *)> owned(
+      blob, [](VipsBlob *blob) { vips_area_unref(VIPS_AREA(blob)); });
+  size_t size;
+  auto *data = static_cast<const char *>(vips_blob_get(blob, &size));
+  return std::vector<char>(data, data + size);
+}
+
+// With alpha "mask", JPEG variants of images with an alpha channel are
+// tiled as PNG and every tile is then split by add_masked_tile
+bool masks_alpha(const VImage &image, const OutputVariant &variant,
+                 const std::string &alpha) {
+  return alpha == "mask" && image.has_alpha() &&
+         (variant.suffix == ".jpg" || variant.suffix == ".jpeg");
+}
+
+// Store a PNG tile with alpha as a JPEG colour tile plus, if it is partly
+// transparent, a PNG alpha mask: 1-bit when every pixel is fully on or off,
+// 8-bit otherwise. Fully transparent tiles are dropped and opaque ones get
+// no mask.
+void add_masked_tile(TileSink &tiles, const std::string &key,
+                     const std::vector<char> &png, int quality) {
+  VImage tile = VImage::new_from_buffer(png.data(), png.size(), "");
+  VImage alpha = tile.extract_band(tile.bands() - 1);
+  if (alpha.format() == VIPS_FORMAT_USHORT) {
+    alpha = (alpha / 257).cast(VIPS_FORMAT_UCHAR);
+  }
+  if (alpha.max() == 0) {
+    return;
+  }
+
+  VImage colour =
+      tile.extract_band(0, VImage::option()->set("n", tile.bands() - 1));
+  tiles.add(key, take_blob(colour.jpegsave_buffer(
+                     VImage::option()->set("Q", quality))));
+
+  if (alpha.min() < 255) {
+    bool binary = ((alpha > 0) & (alpha < 255)).max() == 0;
+    tiles.add_mask(key, take_blob(alpha.pngsave_buffer(VImage::option()->set(
+                            "bitdepth", binary ? 1 : 8))));
+  }
+}
+
+// Tile an already resized image in memory. With `level` set, only this
+// image is tiled (dzsave depth one) and its tiles are filed under `level`,
+// offset by the tile row and column the image starts at.
+void tile_pyramid(const VImage &image, const OutputVariant &variant,
+                  const std::string &shrink, const std::string &alpha,
+                  TileSink &tiles, int level = -1, int first_y = 0,
+                  int first_x = 0) {
+  bool masked = masks_alpha(image, variant, alpha);
+  OutputVariant encoded = variant;
+  if (masked) {
+    encoded.suffix = ".png";
+  }
+
+  VOption *options = dzsave_options(encoded, shrink);
+  if (level >= 0) {
+    options->set("depth", VIPS_FOREIGN_DZ_DEPTH_ONE);
+  }
+  for_each_dzsave_tile(
+      image, options,
+      [&](int tile_level, int y, int x, const std::vector<char> &data) {
+        std::string key =
+            level >= 0 ? make_tile_key(level, first_y + y, first_x + x)
+                       : make_tile_key(tile_level, y, x);
+        if (masked) {
+          add_masked_tile(tiles, key, data, variant.quality);
+        } else {
+          tiles.add(key, data);
+        }
+      });
+}
+
+// Resolution levels already stored in the input, largest first: the
+// subIFDs of a pyramidal (OME-)TIFF, the levels of a slide read through
+// OpenSlide or the pages of a multi-page pyramid. Anything that is not
+// strictly smaller than the level before, such as the frames of an
+// animation or the label image of a slide, ends the list.
+std::vector<VImage> source_levels(const std::string &path) {
+  VImage image = VImage::new_from_file(path.c_str());
+  std::vector<VImage> levels = {image};
+
+  const char *option = nullptr;
+  int first = 1;
+  int count = 0;
+  if (image.get_typeof("n-subifds")) {
+    option = "subifd";
+    first = 0;
+    count = image.get_int("n-subifds");
+  } else if (image.get_typeof("openslide.level-count")) {
+    option = "level";
+    count = std::atoi(image.get_string("openslide.level-count"));
+  } else if (image.get_typeof("n-pages")) {
+    option = "page";
+    count = image.get_int("n-pages");
+  }
+
+  double aspect = static_cast<double>(image.width()) / image.height();
+  for (int i = first; i < count; ++i) {
+    VImage level = VImage::new_from_file(path.c_str(),
+                                         VImage::option()->set(option, i));
+    const VImage &previous = levels.back();
+    double level_aspect = static_cast<double>(level.width()) / level.height();
+    if (level.width() >= previous.width() ||
+        level.height() >= previous.height() ||
+        std::abs(level_aspect - aspect) > 0.01 * aspect) {
+      break;
+    }
+    levels.push_back(level);
+  }
+  return levels;
+}
+
+// Options to open an image for a single top-to-bottom pass. Strip-based
+// formats (JPEG, PNG, strip TIFF) then decode through a small band of
+// scanlines instead of into a full-size buffer first.
+VOption *sequential_access() {
+  return VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL);
+}
+
+// Google layout with depth onetile: halve until one tile holds the level
+int pyramid_depth(int target_size, int tile_size) {
+  return log2_exact((target_size + tile_size - 1) / tile_size);
+}
+
+// Tile columns [first_x, end_x) and rows [first_y, end_y) of one level
+struct LevelTiles {
+  int first_x;
+  int first_y;
+  int end_x;
+  int end_y;
+};
+
+// Tiles of a level of `size` pixels that cover the region of interest of
+// `range`, widened by its margin, once a width x height source is stretched
+// to the square
+LevelTiles covered_tiles(const TileRange &range, int width, int height,
+                         int size, int tile_size) {
+  int left = 0;
+  int top = 0;
+  int right = width;
+  int bottom = height;
+  if (range.width > 0) {
+    left = std::max(range.left, 0);
+    top = std::max(range.top, 0);
+    right = std::min(range.left + range.width, width);
+    bottom = std::min(range.top + range.height, height);
+    if (left >= right || top >= bottom) {
+      throw std::runtime_error("region of interest lies outside the " +
+                               std::to_string(width) + "x" +
+                               std::to_string(height) + " image");
+    }
+  }
+
+  auto level_floor = [&](int pixel, int extent) {
+    int64_t scaled = int64_t(pixel) * size / extent - range.margin;
+    return static_cast<int>(std::max<int64_t>(scaled, 0) / tile_size);
+  };
+  auto level_ceil = [&](int pixel, int extent) {
+    int64_t scaled =
+        (int64_t(pixel) * size + extent - 1) / extent + range.margin;
+    int tiles = (size + tile_size - 1) / tile_size;
+    return std::min(static_cast<int>((scaled + tile_size - 1) / tile_size),
+                    tiles);
+  };
+  return {level_floor(left, width), level_floor(top, height),
+          level_ceil(right, width), level_ceil(bottom, height)};
+}
+
+// Index of the smallest of the resolution levels of an input, largest
+// first, that still has at least the resolution of an output level of
+// `size` pixels
+size_t source_level(const std::vector<VImage> &levels, int target_size,
+                    int size) {
+  const VImage &full = levels.front();
+  double scale = static_cast<double>(size) / target_size;
+
+  size_t source = 0;
+  while (source + 1 < levels.size() &&
+         levels[source + 1].width() >= full.width() * scale &&
+         levels[source + 1].height() >= full.height() * scale) {
+    ++source;
+  }
+  return source;
+}
+
+// One output level of `size` pixels resampled from source_level, so the
+// coarse levels of a pyramidal input never touch the full-resolution pixels
+VImage resample_level(const std::vector<VImage> &levels, int target_size,
+                      int size, const std::string &kernel,
+                      const std::string &normalize) {
+  return resize_to(
+      normalize_colour(levels[source_level(levels, target_size, size)],
+                       normalize),
+      size, size, kernel);
+}
+
+// Whether output level `level` of a pyramid `depth` deep is resampled from
+// the input rather than shrunk from the level below: the full-resolution
+// level, and levels for which the input stores a smaller level than for
+// the one below
+bool resamples_level(const std::vector<VImage> &levels, int target_size,
+                     int depth, int level) {
+  return level == depth ||
+         source_level(levels, target_size, target_size >> (depth - level)) !=
+             source_level(levels, target_size,
+                          target_size >> (depth - level - 1));
+}
+
+// The next coarser level of an image of even width and height, built the
+// way dzsave's region shrink builds it from each 2x2 block of pixels: the
+// rounded mean, the smaller of the two larger ones of each row (median),
+// the first repeated value (mode), the max, the min, or the top left one
+// (nearest). Levels shrunk here therefore match those of a dzsave run.
+VImage shrink_level(const VImage &image, const std::string &shrink) {
+  level_shrink(shrink); // throws for an unknown name
+  if (shrink == "nearest") {
+    return image.subsample(2, 2);
+  }
+
+  // The four pixels of a block come from four views of the same image, so
+  // a cache keeps each region of it from being computed four times
+  VImage cached = image.tilecache(VImage::option()->set("threaded", true));
+  auto corner = [&](int x, int y) {
+    return cached.embed(-x, -y, image.width(), image.height())
+        .subsample(2, 2);
+  };
+  VImage a = corner(0, 0);
+  VImage b = corner(1, 0);
+  VImage c = corner(0, 1);
+  VImage d = corner(1, 1);
+  auto larger = [](const VImage &x, const VImage &y) {
+    return (x > y).ifthenelse(x, y);
+  };
+  auto smaller = [](const VImage &x, const VImage &y) {
+    return (x < y).ifthenelse(x, y);
+  };
+  if (shrink == "max") {
+    return larger(larger(a, b), larger(c, d));
+  }
+  if (shrink == "min") {
+    return smaller(smaller(a, b), smaller(c, d));
+  }
+  if (shrink == "median") {
+    return smaller(larger(a, b), larger(c, d));
+  }
+  if (shrink == "mode") {
+    VImage a_repeats = (a == b) | (a == c) | (a == d);
+    VImage b_repeats = (b == c) | (b == d);
+    return a_repeats.ifthenelse(a, b_repeats.ifthenelse(b, c));
+  }
+
+  VImage sum = a + b + c + d;
+  VipsBandFormat format = image.format();
+  if (format == VIPS_FORMAT_FLOAT || format == VIPS_FORMAT_DOUBLE) {
+    return (sum / 4).cast(format);
+  }
+  return ((sum + 2) / 4).floor().cast(format);
+}
+
+// Pixels [left, right) x [top, bottom) of a level
+struct LevelRect {
+  int left;
+  int top;
+  int right;
+  int bottom;
+};
+
+// Tile the levels of one variant that cover the regions of interest of
+// `ranges`, which share the levels of the first one, from the resolution
+// levels of an input, largest first. The finest level is resampled by
+// resample_level, and each coarser one is shrunk from the level below with
+// the level shrink of `options`, as dzsave builds its pyramid. Where the
+// input stores a smaller level with a coarser level's resolution, that
+// level is resampled from it instead. Every level is computed only over the
+// tiles it needs, plus what the coarser ones shrink from it. Shrunk levels
+// are kept (see cache_resized), so the input is read once, not once per
+// level. Tiles come level by level, and for a single range in the same
+// order as from a single dzsave run.
+void tile_levels(const std::vector<VImage> &levels,
+                 const OutputVariant &variant, int target_size,
+                 const TilerOptions &options,
+                 const std::vector<TileRange> &ranges, TileSink &tiles) {
+  const VImage &full = levels.front();
+  int tile_size = variant.tile_size;
+  int depth = pyramid_depth(target_size, tile_size);
+  const TileRange &first_range = ranges.front();
+  int first = first_range.min_level;
+  int last = first_range.max_level < 0
+                 ? depth
+                 : std::min(first_range.max_level, depth);
+  if (first > last) {
+    return;
+  }
+
+  // The finest level is shrunk from the levels above it, up to the one it
+  // is resampled from
+  int finest = last;
+  while (!resamples_level(levels, target_size, depth, finest)) {
+    ++finest;
+  }
+
+  std::vector<std::vector<LevelTiles>> covered(finest + 1);
+  std::vector<LevelRect> needed(finest + 1);
+  for (int level = first; level <= finest; ++level) {
+    int size = target_size >> (depth - level);
+    LevelRect rect{size, size, 0, 0};
+    auto include = [&](int left, int top, int right, int bottom) {
+      rect.left = std::min(rect.left, left);
+      rect.top = std::min(rect.top, top);
+      rect.right = std::max(rect.right, right);
+      rect.bottom = std::max(rect.bottom, bottom);
+    };
+    if (level <= last) {
+      for (const auto &range : ranges) {
+        LevelTiles level_tiles = covered_tiles(range, full.width(),
+                                               full.height(), size, tile_size);
+        covered[level].push_back(level_tiles);
+        include(level_tiles.first_x * tile_size,
+                level_tiles.first_y * tile_size,
+                std::min(level_tiles.end_x * tile_size, size),
+                std::min(level_tiles.end_y * tile_size, size));
+      }
+    }
+    if (level > first) {
+      const LevelRect &coarser = needed[level - 1];
+      include(2 * coarser.left, 2 * coarser.top, 2 * coarser.right,
+              2 * coarser.bottom);
+    }
+    needed[level] = rect;
+  }
+
+  std::vector<VImage> images(finest + 1);
+  for (int level = finest; level >= first; --level) {
+    int size = target_size >> (depth - level);
+    const LevelRect &rect = needed[level];
+    int width = rect.right - rect.left;
+    int height = rect.bottom - rect.top;
+    if (resamples_level(levels, target_size, depth, level)) {
+      // Resampling is lazy, so only the cropped area is computed
+      VImage image = resample_level(levels, target_size, size, options.kernel,
+                                    options.normalize);
+      if (width < size || height < size) {
+        image = image.crop(rect.left, rect.top, width, height);
+      }
+      images[level] = image;
+    } else {
+      const LevelRect &finer = needed[level + 1];
+      VImage image = shrink_level(
+          images[level + 1].crop(2 * rect.left - finer.left,
+                                 2 * rect.top - finer.top, 2 * width,
+                                 2 * height),
+          options.level_shrink);
+      images[level] = cache_resized(image, options.variant_cache_mb);
+    }
+  }
+
+  for (int level = first; level <= last; ++level) {
+    const LevelRect &rect = needed[level];
+    for (const auto &level_tiles : covered[level]) {
+      int left = level_tiles.first_x * tile_size;
+      int top = level_tiles.first_y * tile_size;
+      int right = std::min(level_tiles.end_x * tile_size, rect.right);
+      int bottom = std::min(level_tiles.end_y * tile_size, rect.bottom);
+      VImage image = images[level];
+      if (left > rect.left || top > rect.top || right < rect.right ||
+          bottom < rect.bottom) {
+        image = image.crop(left - rect.left, top - rect.top, right - left,
+                           bottom - top);
+      }
+      tile_pyramid(image, variant, options.level_shrink, options.alpha, tiles,
+                   level, level_tiles.first_y, level_tiles.first_x);
+    }
+  }
+}
+
+// Tile one variant level by level, either straight from the resolution
+// levels of a pyramidal input or for a restricted range, into its binaries
+// or the archive
+size_t pyramid_variant(const std::vector<VImage> &levels,
+                       const fs::path &output_folder,
+                       const OutputVariant &variant, int target_size,
+                       const TilerOptions &options,
+                       const LevelFiles &level_files) {
+  fs::create_directories(output_folder);
+  const std::string &archive = options.archive;
+  if (archive.empty()) {
+    LevelTileWriter tiles(output_folder, level_files, options.supertile);
+    tile_levels(levels, variant, target_size, options, {options.range},
+                tiles);
+    tiles.finish();
+    write_metadata(output_folder,
+                   tiles.index(target_size, target_size, variant.tile_size));
+    return tiles.tiles().size();
+  }
+
+  std::string name = archive_file_name(archive);
+  fs::path path = output_folder / name;
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot create binary file: " + path.string());
+  }
+
+  StreamSink sink(file);
+  auto archive_writer = make_archive_writer(archive, sink);
+  ArchiveTileWriter tiles(*archive_writer, name, "", variant.suffix);
+  tile_levels(levels, variant, target_size, options, {options.range}, tiles);
+  tiles.finish();
+  tiles.add_index(target_size, target_size, variant.tile_size);
+  archive_writer->finish();
+
+  file.close();
+  if (!file) {
+    throw std::runtime_error("Failed to write " + path.string());
+  }
+  return tiles.tiles().size();
+}
+
+// Tile one variant of an already resized image in memory into a single
+// archive, or with no format into its binaries plus metadata.json, in its
+// output folder and return the number of tiles written
+size_t archive_variant(const VImage &image, const fs::path &output_folder,
+                       const OutputVariant &variant, int target_size,
+                       const std::string &shrink, const std::string &alpha,
+                       int supertile, const LevelFiles &level_files,
+                       const std::string &format) {
+  fs::create_directories(output_folder);
+  if (format.empty()) {
+    LevelTileWriter tiles(output_folder, level_files, supertile);
+    tile_pyramid(image, variant, shrink, alpha, tiles);
+    tiles.finish();
+    write_metadata(output_folder,
+                   tiles.index(target_size, target_size, variant.tile_size));
+    return tiles.tiles().size();
+  }
+
+  std::string name = archive_file_name(format);
+  fs::path path = output_folder / name;
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot create binary file: " + path.string());
+  }
+
+  StreamSink sink(file);
+  auto archive = make_archive_writer(format, sink);
+  ArchiveTileWriter tiles(*archive, name, "", variant.suffix);
+  tile_pyramid(image, variant, shrink, alpha, tiles);
+  tiles.finish();
+  tiles.add_index(target_size, target_size, variant.tile_size);
+  archive->finish();
+
+  file.close();
+  if (!file) {
+    throw std::runtime_error("Failed to write " + path.string());
+  }
+  return tiles.tiles().size();
+}
+
+// Source blocks are hashed in squares of this many pixels
+constexpr int kBlockSize = 256;
+
+// Level pixels regenerated around a changed region, covering the reach of
+// the resampling kernels at up to 2x magnification
+constexpr int kResampleMargin = 8;
+
+// FNV-1a hashes of the decoded pixels of the square blocks of a source
+// image, row by row. Stored next to an output as source.blocks so that a
+// later --update can tell which parts of a new source changed.
+struct SourceBlocks {
+  int width = 0;
+  int height = 0;
+  int block_size = 0;
+  std::vector<uint64_t> hashes;
+};
+
+SourceBlocks hash_source_blocks(const std::string &path) {
+  // One band of block rows at a time, in a single top-to-bottom pass
+  VImage image = VImage::new_from_file(path.c_str(), sequential_access());
+  SourceBlocks blocks{image.width(), image.height(), kBlockSize, {}};
+  int columns = (blocks.width + kBlockSize - 1) / kBlockSize;
+
+  for (int top = 0; top < blocks.height; top += kBlockSize) {
+    int rows = std::min(kBlockSize, blocks.height - top);
+    size_t size;
+    std::unique_ptr<void, void (*)(void *)> band(
+        image.crop(0, top, blocks.width, rows).write_to_memory(&size), g_free);
+    auto *data = static_cast<const unsigned char *>(band.get());
+    size_t row_bytes = size / rows;
+    size_t pixel_bytes = row_bytes / blocks.width;
+
+    for (int column = 0; column < columns; ++column) {
+      size_t start = column * kBlockSize * pixel_bytes;
+      size_t end = std::min(start + kBlockSize * pixel_bytes, row_bytes);
+      uint64_t hash = 14695981039346656037ULL;
+      for (int y = 0; y < rows; ++y) {
+        for (size_t i = start; i < end; ++i) {
+          hash ^= data[y * row_bytes + i];
+          hash *= 1099511628211ULL;
+        }
+      }
+      blocks.hashes.push_back(hash);
+    }
+  }
+  return blocks;
+}
+
+// "<width> <height> <block size>" followed by one hex hash per line. A
+// missing or unreadable file gives no blocks, which forces a full run.
+SourceBlocks read_source_blocks(const fs::path &path) {
+  SourceBlocks blocks;
+  std::ifstream in(path);
+  if (!(in >> blocks.width >> blocks.height >> blocks.block_size) ||
+      blocks.block_size <= 0) {
+    return {};
+  }
+  uint64_t hash;
+  while (in >> std::hex >> hash) {
+    blocks.hashes.push_back(hash);
+  }
+  size_t expected =
+      size_t((blocks.width + blocks.block_size - 1) / blocks.block_size) *
+      ((blocks.height + blocks.block_size - 1) / blocks.block_size);
+  return blocks.hashes.size() == expected ? blocks : SourceBlocks{};
+}
+
+void write_source_blocks(const fs::path &path, const SourceBlocks &blocks) {
+  std::ofstream out(path);
+  out << blocks.width << " " << blocks.height << " " << blocks.block_size
+      << "\n"
+      << std::hex;
+  for (uint64_t hash : blocks.hashes) {
+    out << hash << "\n";
+  }
+  if (!out) {
+    throw std::runtime_error("Failed to write " + path.string());
+  }
+}
+
+// Changed blocks as rectangles: runs of changed blocks within a block row,
+// extended downwards while the rows below change over the same columns
+std::vector<TileRange> changed_regions(const SourceBlocks &previous,
+                                       const SourceBlocks &current) {
+  int size = current.block_size;
+  int columns = (current.width + size - 1) / size;
+  int rows = (current.height + size - 1) / size;
+
+  std::vector<TileRange> regions;
+  std::map<std::pair<int, int>, size_t> open;
+  for (int row = 0; row < rows; ++row) {
+    std::map<std::pair<int, int>, size_t> next;
+    for (int column = 0; column < columns;) {
+      auto changed = [&](int column) {
+        size_t i = size_t(row) * columns + column;
+        return previous.hashes[i] != current.hashes[i];
+      };
+      if (!changed(column)) {
+        ++column;
+        continue;
+      }
+      int first = column;
+      while (column < columns && changed(column)) {
+        ++column;
+      }
+
+      int top = row * size;
+      int bottom = std::min(top + size, current.height);
+      auto run = std::make_pair(first, column);
+      auto found = open.find(run);
+      if (found != open.end()) {
+        regions[found->second].height = bottom - regions[found->second].top;
+        next[run] = found->second;
+      } else {
+        TileRange region;
+        region.left = first * size;
+        region.top = top;
+        region.width = std::min(column * size, current.width) - region.left;
+        region.height = bottom - top;
+        region.margin = kResampleMargin;
+        regions.push_back(region);
+        next[run] = regions.size() - 1;
+      }
+    }
+    open.swap(next);
+  }
+  return regions;
+}
+
+// Passes on the first tile stored under each key and drops repeats, for
+// changed regions that share tiles
+class UniqueTileSink : public TileSink {
+public:
+  explicit UniqueTileSink(TileSink &target) : target_(target) {}
+
+  const TileInfo &add(const std::string &key,
+                      const std::vector<char> &data) override {
+    auto found = tiles_by_key_.find(key);
+    if (found == tiles_by_key_.end()) {
+      found = tiles_by_key_.emplace(key, target_.add(key, data)).first;
+    }
+    return found->second;
+  }
+
+  const TileInfo &add_mask(const std::string &key,
+                           const std::vector<char> &data) override {
+    auto found = masks_by_key_.find(key);
+    if (found == masks_by_key_.end()) {
+      found = masks_by_key_.emplace(key, target_.add_mask(key, data)).first;
+    }
+    return found->second;
+  }
+
+private:
+  TileSink &target_;
+  std::map<std::string, TileInfo> tiles_by_key_;
+  std::map<std::string, TileInfo> masks_by_key_;
+};
+
+// Regenerate the tiles of one variant that cover the changed regions at
+// every level, append them to the binaries of their levels and point
+// metadata.json at them. tile_levels builds them with the same resize and
+// level shrinks as a full run, so they match their untouched neighbours.
+// The bytes of the tiles they replace stay in the binaries until they are
+// compacted. Returns the number of tiles written.
+size_t update_variant(const std::vector<VImage> &levels,
+                      const fs::path &output_folder,
+                      const OutputVariant &variant, int target_size,
+                      const TilerOptions &options,
+                      const LevelFiles &level_files,
+                      const std::vector<TileRange> &regions) {
+  if (regions.empty()) {
+    return 0;
+  }
+
+  TileIndex index = read_metadata(output_folder);
+  if (index.width != target_size || index.tile_size != variant.tile_size) {
+    throw std::runtime_error(
+        output_folder.string() +
+        " was tiled with other settings; remove source.blocks to rebuild it");
+  }
+
+  LevelTileWriter writer(output_folder, level_files, 0, true);
+  UniqueTileSink unique(writer);
+  std::set<std::string> replaced;
+  const VImage &full = levels.front();
+  int depth = pyramid_depth(target_size, variant.tile_size);
+  for (const auto &region : regions) {
+    for (int level = 0; level <= depth; ++level) {
+      LevelTiles covered =
+          covered_tiles(region, full.width(), full.height(),
+                        target_size >> (depth - level), variant.tile_size);
+      for (int y = covered.first_y; y < covered.end_y; ++y) {
+        for (int x = covered.first_x; x < covered.end_x; ++x) {
+          replaced.insert(make_tile_key(level, y, x));
+        }
+      }
+    }
+  }
+  // All regions in one pass, so the levels they share are built once
+  tile_levels(levels, variant, target_size, options, regions, unique);
+  writer.finish();
+
+  // Covered tiles that are now fully transparent drop out of the index
+  auto merge = [&](const std::vector<TileInfo> &old_tiles,
+                   const std::vector<TileInfo> &new_tiles) {
+    std::vector<std::tuple<int, int, int, TileInfo>> sorted;
+    for (const auto *tiles : {&old_tiles, &new_tiles}) {
+      for (const auto &tile : *tiles) {
+        if (tiles == &new_tiles || !replaced.count(tile.key)) {
+          int level, y, x;
+          parse_tile_key(tile.key, level, y, x);
+          sorted.emplace_back(level, y, x, tile);
+        }
+      }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+      return std::tie(std::get<0>(a), std::get<1>(a), std::get<2>(a)) <
+             std::tie(std::get<0>(b), std::get<1>(b), std::get<2>(b));
+    });
+    std::vector<TileInfo> merged;
+    for (const auto &entry : sorted) {
+      merged.push_back(std::get<3>(entry));
+    }
+    return merged;
+  };
+  index.tiles = merge(index.tiles, writer.tiles());
+  index.masks = merge(index.masks, writer.masks());
+
+  // Supertile records that hold a replaced tile are out of date
+  if (index.supertile_size > 0) {
+    std::set<std::string> stale;
+    for (const auto &key : replaced) {
+      int level, y, x;
+      parse_tile_key(key, level, y, x);
+      stale.insert(make_tile_key(level, y / index.supertile_size,
+                                 x / index.supertile_size));
+    }
+    index.supertiles.erase(
+        std::remove_if(index.supertiles.begin(), index.supertiles.end(),
+                       [&](const TileInfo &record) {
+                         return stale.count(record.key) > 0;
+                       }),
+        index.supertiles.end());
+  }
+  write_metadata(output_folder, index);
+  return writer.tiles().size();
+}
+
+} // namespace
+
+int next_power_of_2(int n) {
+  if (n <= 0)
+    return 1;
+  int power = 1;
+  while (power < n) {
+    power *= 2;
+  }
+  return power;
+}
+
+Tiler::Tiler(const TilerOptions &options) : options_(options) {
+  if (options_.variants.empty()) {
+    options_.variants.push_back(OutputVariant());
+  }
+}
+
+ProcessResult Tiler::process(const ImageTask &task, size_t total,
+                             const ProgressFn &progress) {
+  const auto &config = options_;
+  ProcessResult result{task.index, false, "", 0, 0};
+  auto started = std::chrono::steady_clock::now();
+
+  std::string label = task.input_path;
+  if (task.region == kStitchRegion) {
+    label += " (stitch)";
+  } else if (task.region >= 0) {
+    label += " (region " + std::to_string(task.region) + ")";
+  }
+
+  try {
+    size_t tile_count = 0;
+    int target_size = 0;
+    LevelFiles level_files(config.level_files);
+
+    if (task.region == kStitchRegion) {
+      for (const auto &variant : config.variants) {
+        fs::path folder = fs::path(task.output_path) / variant.subfolder;
+        tile_count +=
+            stitch_variant(folder, variant, config.level_shrink, config.split,
+                           config.keep_tiles, target_size);
+      }
+    } else {
+      std::vector<VImage> levels = source_levels(task.input_path);
+      VImage image = levels.front();
+
+      // Get original dimensions
+      int width = image.width();
+      int height = image.height();
+
+      // Calculate target size (next power of 2, square)
+      int max_dim = std::max(width, height);
+      target_size = next_power_of_2(max_dim);
+
+      log_progress(progress, "[" + std::to_string(task.index + 1) + "] " +
+                                 label + ": " + std::to_string(width) + "x" +
+                                 std::to_string(height) + " -> " +
+                                 std::to_string(target_size) + "x" +
+                                 std::to_string(target_size) +
+                                 (levels.size() > 1
+                                      ? " from " +
+                                            std::to_string(levels.size()) +
+                                            " source levels"
+                                      : ""));
+
+      // With --update, an output tiled from the same-sized source before
+      // only gets the tiles covering the blocks that changed
+      fs::path blocks_path = fs::path(task.output_path) / "source.blocks";
+      SourceBlocks blocks;
+      SourceBlocks previous;
+      if (config.update) {
+        blocks = hash_source_blocks(task.input_path);
+        previous = read_source_blocks(blocks_path);
+      }
+
+      if (config.update && previous.width == blocks.width &&
+          previous.height == blocks.height &&
+          previous.block_size == blocks.block_size) {
+        auto regions = changed_regions(previous, blocks);
+        log_progress(progress, "  Updating " + std::to_string(regions.size()) +
+                                   " changed regions");
+        for (const auto &variant : config.variants) {
+          fs::path folder = fs::path(task.output_path) / variant.subfolder;
+          tile_count += update_variant(levels, folder, variant, target_size,
+                                       config, level_files, regions);
+        }
+      } else if (task.region == -1 &&
+                 (levels.size() > 1 || !config.range.whole())) {
+        // Pyramidal input or restricted range: levels are built one by one
+        // over the tiles they need, from the nearest stored level or from
+        // the level below
+        for (const auto &variant : config.variants) {
+          fs::path folder = fs::path(task.output_path) / variant.subfolder;
+          tile_count += pyramid_variant(levels, folder, variant, target_size,
+                                        config, level_files);
+        }
+      } else {
+        // Resizing, tiling and the variant cache all read the image once
+        // from top to bottom, so it can be decoded as a stream
+        image = VImage::new_from_file(task.input_path.c_str(),
+                                      sequential_access());
+        if (config.time_normalize && config.normalize != "off") {
+          // libvips would run the conversion fused with decoding and
+          // tiling, so the decoded image is held first and the conversion
+          // gets a timed pass of its own
+          image = cache_resized(image, config.variant_cache_mb);
+          auto converting = std::chrono::steady_clock::now();
+          image = cache_resized(normalize_colour(image, config.normalize),
+                                config.variant_cache_mb);
+          result.normalize_seconds =
+              std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            converting)
+                  .count();
+        } else {
+          image = normalize_colour(image, config.normalize);
+        }
+
+        // Resize image to square target size
+        image = resize_to(image, target_size, target_size, config.kernel);
+
+        if (config.variants.size() > 1) {
+          image = cache_resized(image, config.variant_cache_mb);
+        }
+
+        for (const auto &variant : config.variants) {
+          fs::path folder = fs::path(task.output_path) / variant.subfolder;
+          if (task.region >= 0) {
+            tile_count += tile_region_variant(
+                image, folder, variant, target_size, config.level_shrink,
+                config.split, task.region, config.keep_tiles);
+          } else if (!config.archive.empty() ||
+                     masks_alpha(image, variant, config.alpha)) {
+            // Masked tiles are split in memory, so they skip the dzsave
+            // folder and its merge
+            tile_count += archive_variant(
+                image, folder, variant, target_size, config.level_shrink,
+                config.alpha, config.supertile, level_files, config.archive);
+          } else {
+            tile_count += tile_variant(image, folder, variant, target_size,
+                                       config.level_shrink, config.keep_tiles,
+                                       config.supertile, level_files,
+                                       progress);
+          }
+        }
+      }
+
+      if (config.update) {
+        write_source_blocks(blocks_path, blocks);
+      }
+    }
+
+    result.success = true;
+    result.width = target_size;
+    result.height = target_size;
+    result.tile_count = tile_count;
+
+    size_t current = ++completed_;
+    log_progress(progress, progress_prefix(current, total) + "✓ " + label +
+                               " -> " + task.output_path + " (" +
+                               std::to_string(tile_count) + " tiles)");
+
+    for (const auto &duplicate : task.duplicate_outputs) {
+      replicate_output(task.output_path, duplicate, config);
+
+      current = ++completed_;
+      log_progress(progress, progress_prefix(current, total) + "✓ " +
+                                 task.input_path + " -> " + duplicate + " (" +
+                                 config.dedupe_link + " of " +
+                                 task.output_path + ")");
+    }
+
+  } catch (const std::exception &e) {
+    // Includes a failed replica, which fails the task as a whole
+    result.success = false;
+    result.error_message = e.what();
+    log_progress(progress, "[ERROR] " + label + ": " + e.what(), true);
+  }
+
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  return result;
+}
+
+// A restricted range crops every level from the image, so it needs random
+// access
+TileIndex Tiler::tile_buffer(const void *data, size_t size, TileSink &tiles,
+                             size_t variant) {
+  return tile_image(
+      VImage::new_from_buffer(data, size, "",
+                              options_.range.whole() ? sequential_access()
+                                                     : VImage::option()),
+      tiles, variant);
+}
+
+TileIndex Tiler::tile_source(VSource source, TileSink &tiles,
+                             size_t variant) {
+  return tile_image(
+      VImage::new_from_source(source, "",
+                              options_.range.whole() ? sequential_access()
+                                                     : VImage::option()),
+      tiles, variant);
+}
+
+TileIndex Tiler::tile_image(VImage image, TileSink &tiles, size_t variant) {
+  const auto &output = options_.variants.at(variant);
+
+  int width = image.width();
+  int height = image.height();
+  int target_size = next_power_of_2(std::max(width, height));
+  if (!options_.range.whole()) {
+    tile_levels({image}, output, target_size, options_, {options_.range},
+                tiles);
+    tiles.finish();
+    return tiles.index(target_size, target_size, output.tile_size);
+  }
+  image = normalize_colour(image, options_.normalize);
+  tile_pyramid(resize_to(image, target_size, target_size, options_.kernel),
+               output, options_.level_shrink, options_.alpha, tiles);
+  tiles.finish();
+  return tiles.index(target_size, target_size, output.tile_size);
+}
+
+TileRenderer::TileRenderer(const std::string &input_path,
+                           const TilerOptions &options, size_t variant)
+    : options_(options),
+      variant_(options.variants.empty() ? OutputVariant()
+                                        : options.variants.at(variant)),
+      levels_(source_levels(input_path)) {
+  const VImage &full = levels_.front();
+  target_size_ = next_power_of_2(std::max(full.width(), full.height()));
+  depth_ = pyramid_depth(target_size_, variant_.tile_size);
+}
+
+// Levels are built as tile_levels builds them: resampled where the input
+// provides them, otherwise shrunk from the level below
+VImage TileRenderer::level_image(int level) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int start = level;
+  while (!resampled_.count(start) &&
+         !resamples_level(levels_, target_size_, depth_, start)) {
+    ++start;
+  }
+  for (int built = start; built >= level; --built) {
+    if (resampled_.count(built)) {
+      continue;
+    }
+    resampled_[built] =
+        resamples_level(levels_, target_size_, depth_, built)
+            ? resample_level(levels_, target_size_,
+                             target_size_ >> (depth_ - built),
+                             options_.kernel, options_.normalize)
+            : shrink_level(resampled_.at(built + 1), options_.level_shrink);
+  }
+  return resampled_.at(level);
+}
+
+void TileRenderer::render(int level, int y, int x, TileSink &tiles) {
+  int tile_size = variant_.tile_size;
+  int size = level >= 0 && level <= depth_ ? target_size_ >> (depth_ - level)
+                                           : 0;
+  int count = (size + tile_size - 1) / tile_size;
+  if (y < 0 || x < 0 || y >= count || x >= count) {
+    throw std::out_of_range("No tile " + make_tile_key(level, y, x));
+  }
+
+  // A level smaller than one tile is padded by dzsave like in a full run
+  int left = x * tile_size;
+  int top = y * tile_size;
+  VImage tile = level_image(level).crop(left, top,
+                                        std::min(tile_size, size - left),
+                                        std::min(tile_size, size - top));
+  tile_pyramid(tile, variant_, options_.level_shrink, options_.alpha, tiles,
+               level, y, x);
+}
+
+} // namespace tiler
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "binz.hpp"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vips/vips8>
+
+// Library interface of the tiler: turns images into Google layout tiles
+// stored as a .binz binary plus index. Each Tiler instance owns all of its
+// state, so independent instances can run side by side in one process.
+// libvips must be initialised (VIPS_INIT) before the first Tiler is used.
+
+namespace tiler {
+
+struct OutputVariant {
+  int tile_size = 512;
+  std::string suffix = ".jpg";
+  int quality = 85;
+  std::string subfolder;
+};
+
+// Part of the Google pyramid to tile: levels min_level..max_level (0 is the
+// single top tile, -1 the full resolution), restricted to the tiles that
+// cover a rectangle of the source image (width 0 for the whole image)
+struct TileRange {
+  int min_level = 0;
+  int max_level = -1;
+  int left = 0;
+  int top = 0;
+  int width = 0;
+  int height = 0;
+  // Extra pixels around the rectangle at every level, e.g. for the reach of
+  // the resampling kernel
+  int margin = 0;
+
+  bool whole() const { return min_level == 0 && max_level < 0 && width == 0; }
+};
+
+struct TilerOptions {
+  // Every image is tiled once per variant; none means a single default one
+  std::vector<OutputVariant> variants;
+  size_t variant_cache_mb = 1024;
+  bool keep_tiles = false;
+  unsigned int split = 1;
+  std::string dedupe_link = "copy";
+  // "tar" or "zip" writes each output as one archive instead of
+  // tiles_000.binz plus metadata.json
+  std::string archive;
+  // Kernel for resizing to the power-of-two square: nearest, linear, cubic,
+  // mitchell, lanczos2 or lanczos3
+  std::string kernel = "lanczos3";
+  // How dzsave shrinks each level into the next coarser one: mean, median,
+  // mode, max, min or nearest (cheapest)
+  std::string level_shrink = "mean";
+  // Conversion to 8-bit sRGB right after decode: off, srgb, or icc (through
+  // the embedded profile)
+  std::string normalize = "off";
+  // Time the --normalize conversion on its own (ProcessResult::
+  // normalize_seconds) for single-resolution inputs tiled whole: the image
+  // is decoded into memory, or a temp file beyond variant_cache_mb, and
+  // then converted in a separate pass. Costs that extra pass and the copy.
+  bool time_normalize = false;
+  // "mask" stores JPEG tiles of images with alpha as colour plus a separate
+  // PNG alpha mask; "keep" leaves alpha to the tile format
+  std::string alpha = "keep";
+  TileRange range;
+  // Keep block hashes of each source next to its output, and when they
+  // exist for a source of the same size, only retile what changed
+  bool update = false;
+  // Tiles per side of the supertile records written into tiles_000.binz,
+  // 0 for plain tiles only
+  int supertile = 0;
+  // Binaries the levels of an output go to (see LevelFiles): "" for a
+  // single tiles_000.binz, "each", or the first levels of groups ("0,4,8")
+  std::string level_files;
+};
+
+struct ImageTask {
+  std::string input_path;
+  std::string output_path;
+  size_t index;
+  // Further destinations whose input is identical to input_path; they get
+  // a replica of this task's output instead of being tiled again
+  std::vector<std::string> duplicate_outputs = {};
+  // Region of a split image this task tiles, -1 for the whole image or
+  // kStitchRegion for the step that joins the regions
+  int region = -1;
+};
+
+constexpr int kStitchRegion = -2;
+
+struct ProcessResult {
+  size_t index;
+  bool success;
+  std::string error_message;
+  int width;
+  int height;
+  size_t tile_count = 0;
+  double seconds = 0;
+  // Time of the colour conversion with time_normalize, -1 if not measured
+  double normalize_seconds = -1;
+};
+
+// Receives the progress lines of one task, e.g. to print them or stream them
+// to a client
+using ProgressFn = std::function<void(const std::string &line, bool error)>;
+
+int next_power_of_2(int n);
+
+class Tiler {
+public:
+  explicit Tiler(const TilerOptions &options);
+
+  const TilerOptions &options() const { return options_; }
+
+  // Tile a file into the output folder of `task`. Never throws; failures
+  // are reported in the result. `total` only labels progress lines.
+  ProcessResult process(const ImageTask &task, size_t total = 0,
+                        const ProgressFn &progress = nullptr);
+
+  // Tile an encoded image held in memory. The tiles go to `tiles`, e.g. a
+  // TileWriter appending to a binary, and the returned index lists where
+  // they went. Throws on failure. An image of up to 192 MB of decoded
+  // pixels (e.g. 8k x 8k RGB) is tiled without touching disk, with peak
+  // memory about the encoded size of its tiles. The pyramid of a larger one
+  // is built in a temporary folder under the system temp directory and read
+  // back one tile at a time, so memory stays bounded.
+  TileIndex tile_buffer(const void *data, size_t size, TileSink &tiles,
+                        size_t variant = 0);
+
+  // Same as tile_buffer for an image read from a libvips source such as a
+  // file descriptor
+  TileIndex tile_source(vips::VSource source, TileSink &tiles,
+                        size_t variant = 0);
+
+  // Tasks (and duplicate outputs) finished successfully by this instance
+  size_t completed() const { return completed_; }
+
+private:
+  TileIndex tile_image(vips::VImage image, TileSink &tiles, size_t variant);
+
+  TilerOptions options_;
+  std::atomic<size_t> completed_{0};
+};
+
+// Renders single tiles of one image on demand, with the geometry and
+// encoding of Tiler::process, so a pyramid can be served without tiling it
+// first. Safe to use from several threads.
+class TileRenderer {
+public:
+  TileRenderer(const std::string &input_path, const TilerOptions &options,
+               size_t variant = 0);
+
+  const OutputVariant &variant() const { return variant_; }
+  int target_size() const { return target_size_; }
+  // Index of the full-resolution level; level 0 is a single tile
+  int depth() const { return depth_; }
+
+  // Render the tile at (level, y, x) into `tiles`, with its alpha mask when
+  // the options ask for masks. Nothing is stored for a tile that masking
+  // drops as fully transparent. Throws std::out_of_range for a tile outside
+  // the pyramid.
+  void render(int level, int y, int x, TileSink &tiles);
+
+private:
+  vips::VImage level_image(int level);
+
+  TilerOptions options_;
+  OutputVariant variant_;
+  std::vector<vips::VImage> levels_;
+  int target_size_;
+  int depth_;
+  // Output levels, resampled or shrunk from the level below, kept once
+  // built so that libvips can reuse their pipelines
+  std::mutex mutex_;
+  std::map<int, vips::VImage> resampled_;
+};
+
+} // namespace tiler
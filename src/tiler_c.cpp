@@ -0,0 +1,178 @@
+#include "tiler_c.h"
+#include "tiler.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+struct tiler_handle {
+  explicit tiler_handle(const ::tiler::TilerOptions &options)
+      : impl(options) {}
+  ::tiler::Tiler impl;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+int fail(const std::string &message) {
+  last_error = message;
+  return -1;
+}
+
+char *copy_bytes(const std::string &bytes) {
+  char *copy = static_cast<char *>(std::malloc(bytes.size() + 1));
+  if (!copy) {
+    throw std::bad_alloc();
+  }
+  std::memcpy(copy, bytes.data(), bytes.size());
+  copy[bytes.size()] = '\0';
+  return copy;
+}
+
+class CallbackSink : public ::tiler::ByteSink {
+public:
+  CallbackSink(tiler_write_fn write, void *user) : write_(write), user_(user) {}
+
+  void write(const char *data, size_t size) override {
+    if (write_(user_, data, size) != 0) {
+      throw std::runtime_error("Binary sink rejected data");
+    }
+  }
+
+private:
+  tiler_write_fn write_;
+  void *user_;
+};
+
+// Fill everything but the binary itself
+void fill_result(const ::tiler::TileIndex &index, tiler_result *result) {
+  std::ostringstream metadata;
+  ::tiler::write_metadata(metadata, index);
+  std::ostringstream binary_index;
+  ::tiler::write_binary_index(binary_index, index);
+
+  result->width = index.width;
+  result->height = index.height;
+  result->tile_size = index.tile_size;
+  result->tile_count = index.tiles.size();
+  result->metadata_json = copy_bytes(metadata.str());
+  result->metadata_json_size = metadata.str().size();
+  result->index = copy_bytes(binary_index.str());
+  result->index_size = binary_index.str().size();
+}
+
+} // namespace
+
+extern "C" {
+
+int tiler_init(const char *program_name) {
+  if (VIPS_INIT(program_name ? program_name : "tiler")) {
+    return fail("Failed to initialize libvips");
+  }
+  return 0;
+}
+
+void tiler_shutdown(void) { vips_shutdown(); }
+
+tiler_handle *tiler_new(const tiler_options *options) {
+  ::tiler::OutputVariant variant;
+  if (options) {
+    if (options->tile_size > 0) {
+      variant.tile_size = options->tile_size;
+    }
+    if (options->suffix) {
+      variant.suffix = options->suffix;
+    }
+    if (options->quality > 0) {
+      variant.quality = options->quality;
+    }
+  }
+  if (variant.suffix != ".jpg" && variant.suffix != ".png" &&
+      variant.suffix != ".webp") {
+    fail("Unsupported suffix: " + variant.suffix);
+    return nullptr;
+  }
+  if (variant.quality > 100) {
+    fail("Quality must be between 1 and 100");
+    return nullptr;
+  }
+
+  try {
+    ::tiler::TilerOptions tiler_options;
+    tiler_options.variants.push_back(variant);
+    return new tiler_handle(tiler_options);
+  } catch (const std::exception &e) {
+    fail(e.what());
+    return nullptr;
+  }
+}
+
+void tiler_free(tiler_handle *handle) { delete handle; }
+
+const char *tiler_last_error(void) { return last_error.c_str(); }
+
+int tiler_tile_buffer(tiler_handle *handle, const void *data, size_t size,
+                      tiler_result *result) {
+  if (!handle || !data || !result) {
+    return fail("Invalid argument");
+  }
+  std::memset(result, 0, sizeof(*result));
+  try {
+    ::tiler::VectorSink sink;
+    ::tiler::TileWriter writer(sink, "tiles_000.binz");
+    auto index = handle->impl.tile_buffer(data, size, writer);
+    fill_result(index, result);
+    result->binary = copy_bytes(std::string(sink.bytes.begin(),
+                                            sink.bytes.end()));
+    result->binary_size = sink.bytes.size();
+    return 0;
+  } catch (const std::exception &e) {
+    tiler_result_free(result);
+    return fail(e.what());
+  }
+}
+
+int tiler_tile_buffer_to_sink(tiler_handle *handle, const void *data,
+                              size_t size, tiler_write_fn write, void *user,
+                              tiler_result *result) {
+  if (!handle || !data || !write || !result) {
+    return fail("Invalid argument");
+  }
+  std::memset(result, 0, sizeof(*result));
+  try {
+    CallbackSink sink(write, user);
+    ::tiler::TileWriter writer(sink, "tiles_000.binz");
+    fill_result(handle->impl.tile_buffer(data, size, writer), result);
+    return 0;
+  } catch (const std::exception &e) {
+    tiler_result_free(result);
+    return fail(e.what());
+  }
+}
+
+int tiler_tile_file(tiler_handle *handle, const char *input_path,
+                    const char *output_folder) {
+  if (!handle || !input_path || !output_folder) {
+    return fail("Invalid argument");
+  }
+  ::tiler::ImageTask task{input_path, output_folder, 0, {}};
+  auto result = handle->impl.process(task);
+  if (!result.success) {
+    return fail(result.error_message);
+  }
+  return 0;
+}
+
+void tiler_result_free(tiler_result *result) {
+  if (!result) {
+    return;
+  }
+  std::free(result->binary);
+  std::free(result->metadata_json);
+  std::free(result->index);
+  std::memset(result, 0, sizeof(*result));
+}
+
+} // extern "C"
@@ -0,0 +1,72 @@
+#ifndef TILER_C_H
+#define TILER_C_H
+
+#include <stddef.h>
+
+/* C interface of the tiler library. Functions return 0 on success and -1 on
+ * failure, in which case tiler_last_error() describes the problem. A tiler
+ * handle may be used from one thread at a time; separate handles are
+ * independent. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tiler_handle tiler_handle;
+
+typedef struct tiler_options {
+  int tile_size;      /* 0 selects 512 */
+  const char *suffix; /* ".jpg", ".png" or ".webp"; NULL selects ".jpg" */
+  int quality;        /* lossy formats only; 0 selects 85 */
+} tiler_options;
+
+/* Output of tiling one image. `binary` holds the gzip-compressed tiles,
+ * `metadata_json` the metadata.json text and `index` the equivalent binary
+ * index, all owned by the result until tiler_result_free(). */
+typedef struct tiler_result {
+  int width;
+  int height;
+  int tile_size;
+  size_t tile_count;
+  char *binary;
+  size_t binary_size;
+  char *metadata_json;
+  size_t metadata_json_size;
+  char *index;
+  size_t index_size;
+} tiler_result;
+
+/* Receives binary bytes as they are produced; returns 0 to continue */
+typedef int (*tiler_write_fn)(void *user, const char *data, size_t size);
+
+/* Start and stop libvips; call once per process */
+int tiler_init(const char *program_name);
+void tiler_shutdown(void);
+
+tiler_handle *tiler_new(const tiler_options *options);
+void tiler_free(tiler_handle *handle);
+
+/* Message of the last failure on this thread */
+const char *tiler_last_error(void);
+
+/* Tile an encoded image held in memory */
+int tiler_tile_buffer(tiler_handle *handle, const void *data, size_t size,
+                      tiler_result *result);
+
+/* Same as tiler_tile_buffer, but the binary is handed to `write` instead of
+ * being kept in the result */
+int tiler_tile_buffer_to_sink(tiler_handle *handle, const void *data,
+                              size_t size, tiler_write_fn write, void *user,
+                              tiler_result *result);
+
+/* Tile an image file into output_folder, as the command line tool does */
+int tiler_tile_file(tiler_handle *handle, const char *input_path,
+                    const char *output_folder);
+
+void tiler_result_free(tiler_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TILER_C_H */